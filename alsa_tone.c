@@ -0,0 +1,256 @@
+/*
+
+    ALSA mmap sidetone backend, see alsa_tone.h
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <alsa/asoundlib.h>
+#include "keyed_tone.h"
+#include "alsa_tone.h"
+#include "keyer_stats.h"
+
+#define ALSA_TONE_RATE 48000
+#define ALSA_TONE_PERIOD 64		/* frames, when none is asked for */
+#define ALSA_TONE_MAX_PERIOD 1024
+#define ALSA_TONE_PERIODS 2		/* in the buffer */
+#define ALSA_TONE_MAX_CHANNELS 8
+
+static snd_pcm_t *pcm;
+static pthread_t alsa_thread_id;
+static volatile int alsa_running;
+static unsigned alsa_rate, alsa_channels;
+static snd_pcm_uframes_t alsa_period;
+
+/*
+** the frame time, like jack_frame_time(): the first frame of the period
+** being rendered in the high half, and the low 32 bits of its
+** CLOCK_MONOTONIC ns timestamp in the low half, published together.
+*/
+static atomic_ullong alsa_cycle;
+
+static uint32_t now_ns() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint32_t)(t.tv_sec * 1000000000ull + t.tv_nsec);
+}
+
+static uint32_t alsa_clock() {
+    uint64_t cycle = atomic_load_explicit(&alsa_cycle, memory_order_acquire);
+    uint32_t elapsed = now_ns() - (uint32_t)cycle;
+
+    return (uint32_t)(cycle >> 32) + (uint64_t)elapsed * alsa_rate / 1000000000;
+}
+
+static int alsa_setup(const char *device, int period) {
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_uframes_t buffer;
+    int err;
+
+    if ((err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", device, snd_strerror(err));
+        return -1;
+    }
+
+    alsa_rate = ALSA_TONE_RATE;
+    alsa_channels = 1;
+    alsa_period = period;
+    buffer = ALSA_TONE_PERIODS * alsa_period;
+
+    snd_pcm_hw_params_malloc(&hw);
+    if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+        (err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels_near(pcm, hw, &alsa_channels)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near(pcm, hw, &alsa_rate, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &alsa_period, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer)) < 0 ||
+        (err = snd_pcm_hw_params(pcm, hw)) < 0) {
+        fprintf(stderr, "cannot set up %s for mmap playback: %s\n", device, snd_strerror(err));
+        snd_pcm_hw_params_free(hw);
+        return -1;
+    }
+    snd_pcm_hw_params_free(hw);
+
+    if (alsa_channels > ALSA_TONE_MAX_CHANNELS) {
+        fprintf(stderr, "%s wants %u channels, at most %d\n", device, alsa_channels, ALSA_TONE_MAX_CHANNELS);
+        return -1;
+    }
+    if (alsa_period > ALSA_TONE_MAX_PERIOD) {
+        fprintf(stderr, "%s wants a %lu frame period, at most %d\n", device, alsa_period, ALSA_TONE_MAX_PERIOD);
+        return -1;
+    }
+
+    /* started by hand once the buffer is full, woken a period at a time */
+    snd_pcm_sw_params_malloc(&sw);
+    if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0 ||
+        (err = snd_pcm_sw_params_set_start_threshold(pcm, sw, ~0ul >> 1)) < 0 ||
+        (err = snd_pcm_sw_params_set_avail_min(pcm, sw, alsa_period)) < 0 ||
+        (err = snd_pcm_sw_params(pcm, sw)) < 0) {
+        fprintf(stderr, "cannot set up %s wakeups: %s\n", device, snd_strerror(err));
+        snd_pcm_sw_params_free(sw);
+        return -1;
+    }
+    snd_pcm_sw_params_free(sw);
+
+    atomic_store(&keyer_stats->audio_period, alsa_period);
+    printf("alsa: %s %u/sec, %u channels, period %lu frames, buffer %lu frames\n",
+           device, alsa_rate, alsa_channels, alsa_period, buffer);
+    return 0;
+}
+
+/* copy a rendered period, interleaved, into the mmap area, or silence if buf is NULL */
+static int alsa_write(const int16_t *buf, snd_pcm_uframes_t nframes) {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames, done = 0;
+    snd_pcm_sframes_t err;
+    int16_t *dst;
+
+    while (done < nframes) {
+        frames = nframes - done;
+        if ((err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames)) < 0)
+            return err;
+        dst = (int16_t *)((char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8);
+        if (buf == NULL)
+            memset(dst, 0, frames * alsa_channels * sizeof(*dst));
+        else
+            memcpy(dst, buf + done * alsa_channels, frames * alsa_channels * sizeof(*dst));
+        if ((err = snd_pcm_mmap_commit(pcm, offset, frames)) < 0)
+            return err;
+        done += frames;
+    }
+    return 0;
+}
+
+/*
+** the render loop, the ALSA side of process().  one period is rendered
+** for every period the device has played, so key events stamped during
+** one period land at the same offset in the next, as they do in JACK.
+** with OSCILLATOR_Q the period is rendered straight to 16 bits, with
+** no float in the loop, otherwise as floats and converted.
+*/
+static void* alsa_tone_thread(void *arg) {
+    int16_t pcm_buf[ALSA_TONE_MAX_PERIOD * ALSA_TONE_MAX_CHANNELS];
+#ifndef OSCILLATOR_Q
+    float buf[ALSA_TONE_MAX_PERIOD], *out = buf;
+    snd_pcm_uframes_t k;
+    unsigned c;
+#endif
+    uint32_t frame = 0;		/* first frame of the period to render */
+    uint32_t start, ns, period_ns = (uint64_t)alsa_period * 1000000000 / alsa_rate;
+    snd_pcm_sframes_t avail;
+    unsigned load;
+    int err, idle;
+
+    memset(pcm_buf, 0, sizeof(pcm_buf));	/* touch it before the first period */
+#ifndef OSCILLATOR_Q
+    memset(buf, 0, sizeof(buf));
+#endif
+
+    while (alsa_running) {
+        avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            if (avail == -EPIPE)
+                atomic_fetch_add_explicit(&keyer_stats->xruns, 1, memory_order_relaxed);
+            if ((err = snd_pcm_recover(pcm, avail, 1)) < 0) {
+                fprintf(stderr, "alsa: cannot recover: %s\n", snd_strerror(err));
+                break;
+            }
+            continue;
+        }
+        if (avail < (snd_pcm_sframes_t)alsa_period) {
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED &&
+                (err = snd_pcm_start(pcm)) < 0) {
+                fprintf(stderr, "alsa: cannot start: %s\n", snd_strerror(err));
+                break;
+            }
+            if ((err = snd_pcm_wait(pcm, 1000)) < 0)
+                snd_pcm_recover(pcm, err, 1);
+            continue;
+        }
+
+        start = now_ns();
+        atomic_store_explicit(&alsa_cycle, ((uint64_t)frame << 32) | start, memory_order_release);
+#ifdef OSCILLATOR_Q
+        idle = keyed_tone_render_s16(pcm_buf, alsa_channels, frame - alsa_period, alsa_period);
+#else
+        idle = keyed_tone_render(&out, 1, NULL, frame - alsa_period, alsa_period);
+        if (!idle)
+            for (k = 0; k < alsa_period; k++) {
+                /* saturated, a gain over 0 dB takes the tone past full scale */
+                float v = buf[k] * 32768;
+                int16_t x = v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t)v;
+
+                for (c = 0; c < alsa_channels; c++)
+                    pcm_buf[k * alsa_channels + c] = x;
+            }
+#endif
+        if ((err = alsa_write(idle ? NULL : pcm_buf, alsa_period)) < 0) {
+            if (err == -EPIPE)
+                atomic_fetch_add_explicit(&keyer_stats->xruns, 1, memory_order_relaxed);
+            snd_pcm_recover(pcm, err, 1);
+            continue;
+        }
+
+        /* with no server between us and the device, the load is ours alone */
+        ns = now_ns() - start;
+        latency_record(&keyer_stats->render_ns, ns);
+        load = (uint64_t)ns * 10000 / period_ns;
+        atomic_store_explicit(&keyer_stats->dsp_load, load, memory_order_relaxed);
+        stats_max(&keyer_stats->dsp_load_max, load);
+        frame += alsa_period;
+    }
+    return NULL;
+}
+
+int alsa_tone_start(const char *device, long volume, double freq, int envelope, int window,
+                    int period, int rt_priority) {
+    pthread_attr_t attr;
+    struct sched_param param;
+    int err;
+
+    if (alsa_setup(device, period > 0 ? period : ALSA_TONE_PERIOD) < 0)
+        return -1;
+    keyed_tone_attach(volume, freq, envelope, window, alsa_rate, alsa_clock);
+
+    pthread_attr_init(&attr);
+    if (rt_priority > 0) {
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        param.sched_priority = rt_priority;
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    atomic_store(&alsa_cycle, now_ns());	/* frame 0 is now */
+    alsa_running = 1;
+    err = pthread_create(&alsa_thread_id, &attr, alsa_tone_thread, NULL);
+    if (err && rt_priority > 0) {
+        fprintf(stderr, "alsa: no SCHED_FIFO priority %d: %s\n", rt_priority, strerror(err));
+        err = pthread_create(&alsa_thread_id, NULL, alsa_tone_thread, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    if (err) {
+        fprintf(stderr, "pthread_create for alsa_tone_thread failed %d\n", err);
+        alsa_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void alsa_tone_close() {
+    if (alsa_running) {
+        alsa_running = 0;
+        pthread_join(alsa_thread_id, NULL);
+    }
+    if (pcm) {
+        snd_pcm_drop(pcm);
+        snd_pcm_close(pcm);
+    }
+}
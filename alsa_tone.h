@@ -0,0 +1,18 @@
+/*
+
+    ALSA mmap sidetone backend, an alternative to JACK for boards that
+    only need the sidetone.  renders the same keyed_tone_t, in tiny
+    periods from a thread of its own, and takes the key through the
+    same keyed_tone_key() and keyed_tone_key_at() calls.  with several
+    keyers their sidetones are mixed into every channel of the device.
+
+*/
+
+#ifndef ALSA_TONE_H
+#define ALSA_TONE_H
+
+int alsa_tone_start(const char *device, long volume, double freq, int envelope, int window,
+                    int period, int rt_priority);
+void alsa_tone_close();
+
+#endif
@@ -0,0 +1,323 @@
+/*
+
+    offline render benchmark for keyed_tone.h, needs neither JACK nor GPIO.
+
+    make bench builds one of these per oscillator variant and runs them all.
+    each renders minutes of PARIS at a fixed speed through the block, the
+    per sample and the 16 bit paths, for a range of sample rates and
+    envelopes, and reports
+    ns/sample, cycles/sample and the key click sidelobe level, then the
+    ramp setup costs and the key clicks of each ramp window.
+
+    bench [-m minutes] [-s speed_wpm] [-f freq_hz] [-n period_frames]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define KEYED_TONE_STORAGE
+#include "keyed_tone.h"
+
+#if defined(OSCILLATOR_Z) && defined(OSCILLATOR_D)
+#define OSC_NAME "Z double"
+#elif defined(OSCILLATOR_Z)
+#define OSC_NAME "Z float"
+#elif defined(OSCILLATOR_F) && defined(OSCILLATOR_D)
+#define OSC_NAME "F double"
+#elif defined(OSCILLATOR_F)
+#define OSC_NAME "F float"
+#elif defined(OSCILLATOR_T) && defined(OSCILLATOR_D)
+#define OSC_NAME "T double"
+#elif defined(OSCILLATOR_T)
+#define OSC_NAME "T float"
+#elif defined(OSCILLATOR_R)
+#define OSC_NAME "R float"
+#elif defined(OSCILLATOR_Q)
+#define OSC_NAME "Q fixed"
+#endif
+
+#define PURITY_MS 500		/* length of keying analysed for key clicks */
+#define PURITY_OFFSET 250	/* Hz from the carrier where clicks are measured */
+#define PURITY_SPAN 3000	/* Hz from the carrier to search */
+#define PURITY_STEP 10		/* Hz between analysis frequencies */
+
+static const char paris[] = ".--. .- .-. .. ...";
+
+static int rates[] = { 8000, 48000, 96000, 192000 };
+static int envelopes[] = { 1, 5, 10 };
+
+static double minutes = 1;
+static int speed = 25;
+static int freq = 700;
+static int period = 64;
+
+static int cycles_fd = -1;
+static volatile float sink;
+
+static void cycles_open() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cycles_read() {
+    uint64_t c;
+
+    if (cycles_fd < 0 || read(cycles_fd, &c, sizeof(c)) != sizeof(c))
+        return 0;
+    return c;
+}
+
+static double now_ns() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/*
+** the PARIS keying pattern as alternating on and off lengths in samples,
+** 50 dot lengths in all.
+*/
+static int paris_schedule(int *len, int rate) {
+    int dot = rate * 1.2 / speed;
+    int i, n = 0;
+
+    for (i = 0; paris[i]; i += 1) {
+        if (paris[i] == ' ') {
+            len[n-1] += 2 * dot;	/* letter space, one dot is already there */
+            continue;
+        }
+        len[n++] = (paris[i] == '.') ? dot : 3 * dot;
+        len[n++] = dot;
+    }
+    len[n-1] += 4 * dot;		/* word space */
+    return n;
+}
+
+#define RENDER_SAMPLE 0	/* keyed_tone_process() */
+#define RENDER_BLOCK 1		/* keyed_tone_process_block() */
+#define RENDER_S16 2		/* keyed_tone_process_block_s16() */
+
+/*
+** render nsamples of keying in periods, like process() does, applying
+** the key transitions at their exact sample.  out holds one period,
+** or all nsamples if keep is set, converted to float for RENDER_S16.
+*/
+static void render(keyed_tone_t *p, float *buf, long nsamples, int rate, int how, int keep) {
+    int len[64], n = paris_schedule(len, rate);
+    int e = 0, left = len[0], i, m, on = 1;
+    int16_t *out16 = malloc(period * sizeof(int16_t));
+    long done;
+    float *out;
+
+    keyed_tone_on(p);
+    for (done = 0; done + period <= nsamples; done += period) {
+        out = keep ? buf + done : buf;
+        for (i = 0; i < period; i += m) {
+            m = period - i;
+            if (m > left) m = left;
+            if (how == RENDER_S16)
+                keyed_tone_process_block_s16(p, out16+i, m);
+            else if (how == RENDER_BLOCK)
+                keyed_tone_process_block(p, out+i, m);
+            else {
+                int j;
+                for (j = 0; j < m; j += 1)
+                    out[i+j] = crealf(keyed_tone_process(p));
+            }
+            left -= m;
+            if (left == 0) {
+                e = (e + 1) % n;
+                left = len[e];
+                on = ! on;
+                if (on)
+                    keyed_tone_on(p);
+                else
+                    keyed_tone_off(p);
+            }
+        }
+        if (how == RENDER_S16) {
+            if (keep)
+                for (i = 0; i < period; i += 1)
+                    out[i] = out16[i] * (1.0f / 32768);
+            sink += out16[period-1];
+        }
+        else
+            sink += out[period-1];
+    }
+    free(out16);
+}
+
+/*
+** peak level of the keying sidebands beyond PURITY_OFFSET from the
+** carrier, relative to the carrier, over a Blackman-Harris window of
+** the keyed tone.
+*/
+static double purity(float gain, int rate, int envelope, window_type_t window, int how) {
+    int size = (rate / 1000 * PURITY_MS) / period * period;
+    float *x = malloc(size * sizeof(float));
+    keyed_tone_t tone;
+    double carrier = 0, worst = 0;
+    int d, k;
+
+    memset(&tone, 0, sizeof(tone));
+    keyed_tone_init(&tone, gain, freq, window, envelope, envelope, rate);
+    render(&tone, x, size, rate, how, 1);
+    for (k = 0; k < size; k += 1)
+        x[k] *= window_get(WINDOW_BLACKMAN_HARRIS, size, k);
+
+    for (d = -PURITY_SPAN; d <= PURITY_SPAN; d += PURITY_STEP) {
+        double w = dtwo_pi * (freq + d) / rate, c = 2 * cos(w);
+        double s0, s1 = 0, s2 = 0, power;
+
+        if (freq + d <= 0 || freq + d >= rate / 2)
+            continue;
+        for (k = 0; k < size; k += 1) {	/* goertzel */
+            s0 = x[k] + c * s1 - s2;
+            s2 = s1;
+            s1 = s0;
+        }
+        power = s1 * s1 + s2 * s2 - c * s1 * s2;
+        if (abs(d) < PURITY_OFFSET) {
+            if (power > carrier) carrier = power;
+        }
+        else if (power > worst) worst = power;
+    }
+    free(x);
+    return 10 * log10(worst / carrier);
+}
+
+static void bench(int rate, int envelope) {
+    /* whole periods, as many as render() gets through, and one at least */
+    long nsamples = (long)(minutes * 60 * rate) / period * period;
+    float *out = malloc(period * sizeof(float));
+    double ns[3], t;
+    uint64_t cyc[3], c;
+    keyed_tone_t tone;
+    int how;
+
+    if (nsamples < period)
+        nsamples = period;
+    for (how = RENDER_S16; how >= RENDER_SAMPLE; how -= 1) {
+        memset(&tone, 0, sizeof(tone));
+        keyed_tone_init(&tone, -6, freq, WINDOW_BLACKMAN_HARRIS, envelope, envelope, rate);
+        t = now_ns();
+        c = cycles_read();
+        render(&tone, out, nsamples, rate, how, 0);
+        cyc[how] = cycles_read() - c;
+        ns[how] = now_ns() - t;
+    }
+
+    printf("%-9s %6d %3d ms  block %6.2f ns %6.2f cyc  sample %6.2f ns %6.2f cyc  s16 %6.2f ns %6.2f cyc  clicks %7.1f dBc s16 %7.1f dBc\n",
+           OSC_NAME, rate, envelope,
+           ns[RENDER_BLOCK] / nsamples, (double)cyc[RENDER_BLOCK] / nsamples,
+           ns[RENDER_SAMPLE] / nsamples, (double)cyc[RENDER_SAMPLE] / nsamples,
+           ns[RENDER_S16] / nsamples, (double)cyc[RENDER_S16] / nsamples,
+           purity(-6, rate, envelope, WINDOW_BLACKMAN_HARRIS, RENDER_BLOCK),
+           purity(-6, rate, envelope, WINDOW_BLACKMAN_HARRIS, RENDER_S16));
+    free(out);
+}
+
+/*
+** setup costs: building a ramp table, finding one in the cache, and
+** window_get() and ramp_next() on their own.
+*/
+static void bench_ramp(int rate, int envelope) {
+    ramp_t r;
+    double t, build, lookup, window, next;
+    int i, k, reps = 20, target = ramp_length(envelope, rate);
+    float *table = malloc(target * sizeof(float));
+    float v = 0;
+
+    t = now_ns();
+    for (i = 0; i < reps; i += 1)
+        ramp_build(table, WINDOW_BLACKMAN_HARRIS, target);
+    build = (now_ns() - t) / ((double)reps * target);
+
+    ramp_init(&r, WINDOW_BLACKMAN_HARRIS, envelope, rate);
+    t = now_ns();
+    for (i = 0; i < reps * 1000; i += 1)
+        ramp_update(&r, WINDOW_BLACKMAN_HARRIS, envelope, rate, 0);
+    lookup = (now_ns() - t) / (reps * 1000);
+
+    t = now_ns();
+    for (i = 0; i < reps; i += 1)
+        for (k = 0; k < r.target; k += 1)
+            v += window_get(WINDOW_BLACKMAN_HARRIS, 2*r.target-1, k);
+    window = (now_ns() - t) / ((double)reps * r.target);
+
+    t = now_ns();
+    for (i = 0; i < reps; i += 1) {
+        ramp_start_rise(&r);
+        while ( ! ramp_done(&r))
+            v += ramp_next(&r);
+    }
+    next = (now_ns() - t) / ((double)reps * r.target);
+    sink += v + table[target-1];
+
+    printf("%-9s %6d %3d ms  ramp_build %6.2f ns/point  cached ramp_update %6.2f ns  window_get %6.2f ns  ramp_next %6.2f ns\n",
+           OSC_NAME, rate, envelope, build, lookup, window, next);
+    free(table);
+}
+
+/* key clicks for each ramp window */
+static void bench_window(int rate, int envelope) {
+    int w;
+
+    for (w = 0; window_names[w] != NULL; w += 1)
+        printf("%-9s %6d %3d ms  %-16s clicks %7.1f dBc\n",
+               OSC_NAME, rate, envelope, window_names[w], purity(-6, rate, envelope, w, RENDER_BLOCK));
+}
+
+int main(int argc, char **argv) {
+    int i, j;
+
+    for (i = 1; i < argc; i++)
+        if (argv[i][0] == '-' && i+1 < argc)
+            switch (argv[i][1]) {
+            case 'f':
+                freq = atoi(argv[++i]);
+                break;
+            case 'm':
+                minutes = atof(argv[++i]);
+                break;
+            case 'n':
+                period = atoi(argv[++i]);
+                break;
+            case 's':
+                speed = atoi(argv[++i]);
+                break;
+            default:
+                minutes = 0;
+            }
+    if (!(minutes > 0) || period < 1) {
+        fprintf(stderr, "bench [-m minutes, over 0] [-s speed_wpm] [-f freq_hz] [-n period_frames]\n");
+        exit(1);
+    }
+
+    cycles_open();
+    if (cycles_fd < 0)
+        fprintf(stderr, "bench: no cycle counter, cyc will read 0\n");
+
+    for (i = 0; i < sizeof(rates)/sizeof(rates[0]); i += 1)
+        for (j = 0; j < sizeof(envelopes)/sizeof(envelopes[0]); j += 1)
+            bench(rates[i], envelopes[j]);
+    for (i = 0; i < sizeof(rates)/sizeof(rates[0]); i += 1)
+        bench_ramp(rates[i], 5);
+    bench_window(48000, 5);
+
+    return 0;
+}
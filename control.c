@@ -0,0 +1,203 @@
+/*
+
+    live parameter control, see control.h
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "control.h"
+
+/*
+** a sequence lock: the one writer makes the sequence odd, writes, and
+** makes it even again.  readers copy the parameters out and retry if
+** the sequence was odd or moved underneath them, so they never block
+** or make a system call.  the writers, the control thread and a reload,
+** take turns on a mutex.
+*/
+static atomic_uint params_seq;
+static keyer_params_t params;
+static pthread_mutex_t params_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int control_fd = -1;
+static pthread_t control_thread_id;
+
+void control_publish(const keyer_params_t *p) {
+    unsigned seq;
+
+    pthread_mutex_lock(&params_lock);
+    seq = atomic_load_explicit(&params_seq, memory_order_relaxed);
+    atomic_store_explicit(&params_seq, seq+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&params, p, sizeof(params));
+    atomic_store_explicit(&params_seq, seq+2, memory_order_release);
+    pthread_mutex_unlock(&params_lock);
+}
+
+/* copies the parameters if they changed since *seen, returns 1 if they did */
+int control_fetch(unsigned *seen, keyer_params_t *p) {
+    unsigned seq;
+
+    do {
+        seq = atomic_load_explicit(&params_seq, memory_order_acquire);
+        if (seq == *seen)
+            return 0;
+        memcpy(p, &params, sizeof(*p));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&params_seq, memory_order_relaxed));
+
+    *seen = seq;
+    return 1;
+}
+
+/* the parameters as last published */
+void control_current(keyer_params_t *p) {
+    unsigned seen = 1;		/* odd, so never current */
+
+    control_fetch(&seen, p);
+}
+
+static int *control_field(keyer_params_t *p, const char *name) {
+    if (strcmp(name, "speed") == 0) return &p->speed;
+    if (strcmp(name, "weight") == 0) return &p->weight;
+    if (strcmp(name, "mode") == 0) return &p->mode;
+    if (strcmp(name, "spacing") == 0) return &p->spacing;
+    if (strcmp(name, "reversed") == 0) return &p->reversed;
+    if (strcmp(name, "breakin") == 0) return &p->breakin;
+    if (strcmp(name, "freq") == 0) return &p->freq;
+    if (strcmp(name, "gain") == 0) return &p->gain;
+    return NULL;
+}
+
+/* range checks, so a stray datagram can't stall the keyer */
+static int control_valid(const keyer_params_t *p) {
+    return p->speed >= 1 && p->speed <= 100 &&
+           p->weight >= 10 && p->weight <= 90 &&
+           p->mode >= 0 && p->mode <= 2 &&
+           p->freq > 0 && p->freq < 20000 &&
+           p->gain >= CONTROL_GAIN_MIN && p->gain <= CONTROL_GAIN_MAX;
+}
+
+/*
+** the "name value" pairs in text over p.  returns 0, or -1 with error
+** set to what was wrong and p half changed.
+*/
+int control_parse(const char *text, keyer_params_t *p, char *error, int size) {
+    char name[32];
+    int value, used, *field;
+
+    for (; sscanf(text, "%31s %d%n", name, &value, &used) == 2; text += used) {
+        if ((field = control_field(p, name)) == NULL)
+            break;
+        *field = value;
+    }
+    if (sscanf(text, "%31s", name) == 1)
+        snprintf(error, size, "error at \"%s\"", name);
+    else if (!control_valid(p))
+        snprintf(error, size, "error out of range");
+    else
+        return 0;
+    return -1;
+}
+
+int control_load(const char *path, keyer_params_t *p) {
+    char buf[4096], error[64];
+    keyer_params_t next = *p;
+    FILE *f = fopen(path, "r");
+    size_t n, i;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    n = fread(buf, 1, sizeof(buf)-1, f);
+    fclose(f);
+    buf[n] = 0;
+    /* blank out # comments, to the end of their line */
+    for (i = 0; i < n; i++)
+        if (buf[i] == '#')
+            for (; i < n && buf[i] != '\n'; i++)
+                buf[i] = ' ';
+    if (control_parse(buf, &next, error, sizeof(error)) < 0) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        return -1;
+    }
+    *p = next;
+    return 0;
+}
+
+static void* control_thread(void *arg) {
+    keyer_params_t current, next;
+    char buf[512], error[64];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    int n;
+
+    for (;;) {
+        fromlen = sizeof(from);
+        n = recvfrom(control_fd, buf, sizeof(buf)-1, 0, (struct sockaddr *)&from, &fromlen);
+        if (n < 0)
+            continue;
+        buf[n] = 0;
+
+        /* from what was last published, which a reload may have changed */
+        control_current(&current);
+        next = current;
+        if (control_parse(buf, &next, error, sizeof(error)) < 0)
+            n = snprintf(buf, sizeof(buf), "%s\n", error);
+        else {
+            if (memcmp(&next, &current, sizeof(next)) != 0) {
+                current = next;
+                control_publish(&current);
+            }
+            n = snprintf(buf, sizeof(buf),
+                         "speed %d weight %d mode %d spacing %d reversed %d breakin %d freq %d gain %d\n",
+                         current.speed, current.weight, current.mode, current.spacing,
+                         current.reversed, current.breakin, current.freq, current.gain);
+        }
+        sendto(control_fd, buf, n, 0, (struct sockaddr *)&from, fromlen);
+    }
+    return NULL;
+}
+
+/*
+** there is no authentication, anyone who can reach the socket can key
+** changes into a live transmitter, so it is the loopback's unless an
+** address is asked for.
+*/
+int control_start(const char *host, int port) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (host && inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "control: %s is not an IPv4 address\n", host);
+        return -1;
+    }
+    control_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (control_fd < 0) {
+        perror("control socket");
+        return -1;
+    }
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("control bind");
+        close(control_fd);
+        return -1;
+    }
+
+    if (pthread_create(&control_thread_id, NULL, control_thread, NULL)) {
+        fprintf(stderr, "pthread_create for control_thread failed\n");
+        return -1;
+    }
+    printf("control: listening on udp %s:%d\n", inet_ntoa(addr.sin_addr), port);
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+
+    live parameter control: a UDP socket thread publishes changes into
+    a lock-free mailbox, which the keyer picks up between elements.
+
+    each datagram is one or more "name value" pairs separated by
+    spaces or newlines, e.g. "speed 28 weight 50".  the reply is the
+    full set of parameters in the same form.  names are speed, weight,
+    mode, spacing, reversed, breakin, freq and gain.
+
+    a settings file holds pairs in the same form, read by
+    control_load() at startup and again on a reload.
+
+*/
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/* sidetone dB, boost as well as cut, -g starts at +10 */
+#define CONTROL_GAIN_MIN -60
+#define CONTROL_GAIN_MAX 20
+
+typedef struct {
+    int speed;		/* wpm */
+    int weight;		/* 33-66 */
+    int mode;		/* KEYER_STRAIGHT, KEYER_MODE_A, KEYER_MODE_B */
+    int spacing;	/* strict character spacing */
+    int reversed;	/* paddles swapped */
+    int breakin;	/* a paddle aborts text */
+    int freq;		/* sidetone Hz */
+    int gain;		/* sidetone dB */
+} keyer_params_t;
+
+void control_publish(const keyer_params_t *p);
+int control_fetch(unsigned *seen, keyer_params_t *p);
+void control_current(keyer_params_t *p);
+int control_parse(const char *text, keyer_params_t *p, char *error, int size);
+/* the pairs in a file over p, or -1 and p untouched if they won't do */
+int control_load(const char *path, keyer_params_t *p);
+/* publish the initial set before this, host NULL for the loopback only */
+int control_start(const char *host, int port);
+
+#endif
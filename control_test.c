@@ -0,0 +1,41 @@
+/*
+
+    checks of the control parser against the parameters iambic starts
+    with, run by make test, no GPIO or JACK needed.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "control.h"
+#include "keyer.h"
+
+static int failed = 0;
+
+/* as iambic.c starts with no options */
+static const keyer_params_t defaults = { 20, 55, KEYER_MODE_B, 0, 0, 1, 700, 10 };
+
+static void expect(const char *text, int result, int gain) {
+    keyer_params_t p = defaults;
+    char error[64] = "";
+    int r = control_parse(text, &p, error, sizeof(error));
+
+    if (r != result || (r == 0 && p.gain != gain)) {
+        printf("FAIL \"%s\": %d %s, gain %d\n", text, r, error, p.gain);
+        failed = 1;
+    }
+}
+
+int main() {
+    expect("", 0, 10);
+    expect("speed 28", 0, 10);
+    expect("speed 28 freq 650", 0, 10);
+    expect("gain 20", 0, 20);
+    expect("gain -20", 0, -20);
+    expect("gain 21", -1, 0);
+    expect("speed 0", -1, 0);
+    expect("pitch 600", -1, 0);
+    if (!failed)
+        printf("control_test passed\n");
+    return failed;
+}
@@ -0,0 +1,232 @@
+/*
+
+    GPIO character device paddle input and key output, see gpio_cdev.h
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <linux/gpio.h>
+#include "gpio_cdev.h"
+
+#define GPIO_CDEV_MAX_INPUTS 16		/* paddle pairs and buttons */
+#define GPIO_CDEV_EVENTS 16		/* read at a time */
+
+static int chip_fd = -1;
+static int stop_fd = -1;
+static pthread_t cdev_thread_id;
+static int cdev_running;
+
+static struct {
+    int fd;
+    gpio_cdev_func_t func;
+    void *arg;
+    unsigned lines[2];
+    int nlines;
+    struct { int armed; uint32_t due; } watch[2];	/* gpio_cdev_watchdog(), per line */
+} inputs[GPIO_CDEV_MAX_INPUTS];
+static int ninputs;
+
+int gpio_cdev_open(const char *chip) {
+    chip_fd = open(chip, O_RDWR | O_CLOEXEC);
+    if (chip_fd < 0) {
+        fprintf(stderr, "gpio: cannot open %s: %s\n", chip, strerror(errno));
+        return -1;
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    return 0;
+}
+
+uint32_t gpio_cdev_tick() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint32_t)(t.tv_sec * 1000000ull + t.tv_nsec / 1000);
+}
+
+static int request_inputs(const unsigned *lines, int n, gpio_cdev_func_t func, void *arg) {
+    struct gpio_v2_line_request req;
+    int i;
+
+    if (ninputs == GPIO_CDEV_MAX_INPUTS)
+        return -1;
+
+    /* edge timestamps are CLOCK_MONOTONIC unless asked otherwise */
+    memset(&req, 0, sizeof(req));
+    for (i = 0; i < n; i++)
+        req.offsets[i] = lines[i];
+    req.num_lines = n;
+    strcpy(req.consumer, "iambic-keyer");
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_UP |
+                       GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        if (n > 1)
+            fprintf(stderr, "gpio: cannot request lines %u and %u: %s\n", lines[0], lines[1], strerror(errno));
+        else
+            fprintf(stderr, "gpio: cannot request line %u: %s\n", lines[0], strerror(errno));
+        return -1;
+    }
+
+    inputs[ninputs].fd = req.fd;
+    inputs[ninputs].func = func;
+    inputs[ninputs].arg = arg;
+    memcpy(inputs[ninputs].lines, lines, n * sizeof(lines[0]));
+    inputs[ninputs].nlines = n;
+    ninputs++;
+    return 0;
+}
+
+int gpio_cdev_input(unsigned left, unsigned right, gpio_cdev_func_t func, void *arg) {
+    unsigned lines[2] = { left, right };
+
+    return request_inputs(lines, 2, func, arg);
+}
+
+int gpio_cdev_button(unsigned line, gpio_cdev_func_t func, void *arg) {
+    return request_inputs(&line, 1, func, arg);
+}
+
+int gpio_cdev_output(unsigned line) {
+    struct gpio_v2_line_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = line;
+    req.num_lines = 1;
+    strcpy(req.consumer, "iambic-keyer");
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = 0;
+    req.config.attrs[0].mask = 1;
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        fprintf(stderr, "gpio: cannot request line %u: %s\n", line, strerror(errno));
+        return -1;
+    }
+    return req.fd;
+}
+
+void gpio_cdev_write(int handle, int value) {
+    struct gpio_v2_line_values v = { value ? 1 : 0, 1 };
+
+    ioctl(handle, GPIO_V2_LINE_SET_VALUES_IOCTL, &v);
+}
+
+void gpio_cdev_watchdog(unsigned line, unsigned us) {
+    int i, k;
+
+    for (i = 0; i < ninputs; i++)
+        for (k = 0; k < inputs[i].nlines; k++)
+            if (inputs[i].lines[k] == line) {
+                inputs[i].watch[k].armed = (us != 0);
+                inputs[i].watch[k].due = gpio_cdev_tick() + us;
+            }
+}
+
+/*
+** the watchdogs that are due, called back, and the time to the next
+** one as a ppoll() timeout in t, or NULL if none is armed.
+*/
+static struct timespec *watchdogs(struct timespec *t) {
+    uint32_t now = gpio_cdev_tick(), next = UINT32_MAX;
+    int i, k, armed = 0;
+
+    for (i = 0; i < ninputs; i++)
+        for (k = 0; k < inputs[i].nlines; k++) {
+            if (!inputs[i].watch[k].armed)
+                continue;
+            if ((int32_t)(inputs[i].watch[k].due - now) <= 0) {
+                inputs[i].watch[k].armed = 0;
+                inputs[i].func(inputs[i].lines[k], GPIO_CDEV_TIMEOUT, now, inputs[i].arg);
+            }
+            /* the callback may have armed it again */
+            if (inputs[i].watch[k].armed) {
+                uint32_t wait = inputs[i].watch[k].due - now;
+
+                if ((int32_t)wait < 0)
+                    wait = 0;
+                if (wait < next)
+                    next = wait;
+                armed = 1;
+            }
+        }
+    if (!armed)
+        return NULL;
+    t->tv_sec = next / 1000000;
+    t->tv_nsec = (next % 1000000) * 1000;
+    return t;
+}
+
+static void* cdev_thread(void *arg) {
+    struct pollfd fds[GPIO_CDEV_MAX_INPUTS + 1];
+    struct gpio_v2_line_event ev[GPIO_CDEV_EVENTS];
+    struct timespec t;
+    int i, k, n;
+
+    for (i = 0; i < ninputs; i++) {
+        fds[i].fd = inputs[i].fd;
+        fds[i].events = POLLIN;
+    }
+    fds[ninputs].fd = stop_fd;
+    fds[ninputs].events = POLLIN;
+
+    while (cdev_running) {
+        if (ppoll(fds, ninputs + 1, watchdogs(&t), NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "gpio: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        for (i = 0; i < ninputs; i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            n = read(inputs[i].fd, ev, sizeof(ev));
+            for (k = 0; k < n / (int)sizeof(ev[0]); k++)
+                inputs[i].func(ev[k].offset, ev[k].id == GPIO_V2_LINE_EVENT_RISING_EDGE,
+                               (uint32_t)(ev[k].timestamp_ns / 1000), inputs[i].arg);
+        }
+        watchdogs(&t);
+    }
+    return NULL;
+}
+
+int gpio_cdev_start() {
+    int err;
+
+    cdev_running = 1;
+    err = pthread_create(&cdev_thread_id, NULL, cdev_thread, NULL);
+    if (err) {
+        fprintf(stderr, "gpio: pthread_create failed: %s\n", strerror(err));
+        cdev_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void gpio_cdev_close() {
+    uint64_t one = 1;
+    int i;
+
+    if (cdev_running) {
+        cdev_running = 0;
+        if (write(stop_fd, &one, sizeof(one)) == sizeof(one))
+            pthread_join(cdev_thread_id, NULL);
+    }
+    for (i = 0; i < ninputs; i++)
+        close(inputs[i].fd);
+    ninputs = 0;
+    if (chip_fd >= 0)
+        close(chip_fd);
+    if (stop_fd >= 0)
+        close(stop_fd);
+    chip_fd = stop_fd = -1;
+}
@@ -0,0 +1,43 @@
+/*
+
+    paddle input and key output through the Linux GPIO character
+    device, an alternative to pigpio.  no DMA sampling and no root, just
+    an interrupt per edge: the kernel timestamps each one and a thread
+    of its own blocks in poll() until they arrive, then hands them to
+    the same callback pigpio would have called, tick and all.
+
+    line numbers are offsets on the chip, which on the PI's gpiochip0
+    are the BCM numbers pigpio uses.
+
+*/
+
+#ifndef GPIO_CDEV_H
+#define GPIO_CDEV_H
+
+#include <stdint.h>
+
+typedef void (*gpio_cdev_func_t)(int gpio, int level, uint32_t tick, void *arg);
+
+#define GPIO_CDEV_TIMEOUT 2	/* the level a watchdog calls back with, pigpio's PI_TIMEOUT */
+
+int gpio_cdev_open(const char *chip);
+/* both edges of a pair of pulled up inputs, returns -1 on failure */
+int gpio_cdev_input(unsigned left, unsigned right, gpio_cdev_func_t func, void *arg);
+/* the same for a single one */
+int gpio_cdev_button(unsigned line, gpio_cdev_func_t func, void *arg);
+/* an output driven low, returns the handle for gpio_cdev_write() or -1 */
+int gpio_cdev_output(unsigned line);
+void gpio_cdev_write(int handle, int value);
+/*
+** call an input's callback with GPIO_CDEV_TIMEOUT us from now, once, or
+** with us 0 not at all.  from the input callbacks only, whose thread
+** keeps the time.
+*/
+void gpio_cdev_watchdog(unsigned line, unsigned us);
+/* the microsecond clock the kernel timestamps edges with, like gpioTick() */
+uint32_t gpio_cdev_tick();
+/* once every input has been asked for */
+int gpio_cdev_start();
+void gpio_cdev_close();
+
+#endif
@@ -61,6 +61,7 @@ Boston, MA  02110-1301, USA.
         Speed calculation -  Using standard PARIS timing, dot_period(mS) = 1200/WPM
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -72,17 +73,29 @@ Boston, MA  02110-1301, USA.
 #include <sched.h>
 #include <time.h>
 #include <sys/mman.h>
+#include <malloc.h>
 #include <pthread.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 
 #include <wiringPi.h>
 #include <softTone.h>
 #include <pigpio.h>
+#include "keyer.h"
 #include "keyed_tone.h"
+#include "keyer_stats.h"
+#include "morse.h"
+#include "control.h"
+#include "alsa_tone.h"
+#include "gpio_cdev.h"
+#include "memory.h"
+#include "remote.h"
+#include "journal.h"
 
-static void* keyer_thread(void *arg);
 static pthread_t keyer_thread_id;
+static pthread_t stats_thread_id;
+static pthread_t text_thread_id;
 
 // GPIO pins
 // set to 0 to use the PI's hw:0 audio out for sidetone
@@ -97,263 +110,351 @@ static pthread_t keyer_thread_id;
 #define LEFT_PADDLE_GPIO 15
 #define RIGHT_PADDLE_GPIO 14
 #endif
+#define PTT_GPIO -1     // -1 for no PTT output
 
-#define KEYER_STRAIGHT 0
-#define KEYER_MODE_A 1
-#define KEYER_MODE_B 2
+#define KEYER_TIMING_SLEEP 0    // state machine stepped by a 1 ms sleep loop
+#define KEYER_TIMING_AUDIO 1    // state machine stepped per sample by process()
+#define KEYER_TIMING_PRECISE 2  // state machine run on absolute microsecond deadlines
+
+#define SIDETONE_JACK 0         // keyed_tone.c, a JACK client
+#define SIDETONE_ALSA 1         // alsa_tone.c, straight to the -d device by mmap
+
+#define KEYER_POLL_US 1000      // paddle polling interval during an element
+
+#define KEYER_STACK_PREFAULT (64 * 1024)
+
+#define MAX_KEYERS 4            // paddle, key out sets given with -p
+
+#define BUTTON_HOLDOFF_US 50000 // a memory button pressed again within this is bounce
+
+#define PULL_SETTLE_US 10000    // for the pull-ups to charge the paddle leads, the sidetone starts meanwhile
 
 #define NSEC_PER_SEC (1000000000)
 
-enum {
-    CHECK = 0,
-    PREDOT,
-    PREDASH,
-    SENDDOT,
-    SENDDASH,
-    DOTDELAY,
-    DASHDELAY,
-    DOTHELD,
-    DASHHELD,
-    LETTERSPACE,
-    EXITLOOP
-};
-
-static int dot_memory = 0;
-static int dash_memory = 0;
-static int key_state = 0;
-static int kdelay = 0;
-static int dot_delay = 0;
-static int dash_delay = 0;
-static int kcwl = 0;
-static int kcwr = 0;
-static int *kdot;
-static int *kdash;
 static int cw_keyer_speed = 20;
 static int cw_keyer_weight = 55;
-static int cw_keys_reversed = 0;
 static int cw_keyer_mode = KEYER_MODE_B;
+static int cw_keyer_spacing = 0;
+static int cw_keys_reversed = 0;
+static int cw_keyer_breakin = 1;
 static int cw_keyer_sidetone_frequency = 700;
 static int cw_keyer_sidetone_gain = 10;
 static int cw_keyer_sidetone_envelope = 5;
-static int cw_keyer_spacing = 0;
+static int cw_keyer_sidetone_window = WINDOW_BLACKMAN_HARRIS;
+static int jack_channels = 1;           // sidetone output ports
+static char *jack_connect_regex = NULL; // playback ports to connect, NULL for the first physical ones
+static int midi_note = -1;              // MIDI note for the key on the JACK key port, -1 for none
+static int sidetone_backend = SIDETONE_JACK;
+static int audio_period = 0;            // period in frames to ask for, 0 for the backend's default
+static int element_cache = 0;           // play dots and dashes from pre-rendered copies
+static int idle_ms = 0;                 // silence before the sidetone only zeroes its buffers, 0 for never
 static int cw_active_state = 0;
-static sem_t cw_event;
-
-static int running, keyer_out = 0;
+static int cw_keyer_timing = KEYER_TIMING_SLEEP;
+static int keyer_rt_priority = 0;       // SCHED_FIFO priority, 0 leaves SCHED_OTHER
+static int keyer_cpu = -1;              // CPU for the keyer thread, -1 for any
+static int gpio_cpu = -1;               // CPU for the pigpio or GPIO character device threads
+static cpu_set_t main_cpus;             // main's own, put back once they exist
+static int lock_memory = 0;
+static int control_port = 0;            // UDP port for live parameter changes, 0 for none
+static char control_host[64];           // the address it is bound to, empty for the loopback
+static char *settings_file = NULL;      // name value settings, read again on SIGHUP
+static int ptt_lead_ms = 10;            // PTT up this long before the first key down
+static int ptt_tail_ms = 100;           // and down this long after the last key up
+static int debounce_make_us = 0;        // hold-off after a paddle closes, 0 for none
+static int debounce_break_us = 0;       // and after it opens
+static char *gpio_chip = NULL;          // GPIO character device for the paddles and key, NULL for pigpio
+static char remote_host[64];            // where -R sends the edges, empty for nowhere
+static int remote_port = 0;
+static int remote_what = REMOTE_PADDLE; // which edges it sends
+static int listen_port = 0;             // UDP port -L plays edges from, 0 for none
+static int listen_what = REMOTE_PADDLE; // which edges it expects
+static int listen_depth_ms = 20;        // least jitter buffer depth
+static char journal_file[256];          // -J event journal, empty for none
+static unsigned journal_records = JOURNAL_RECORDS;
+static sem_t cw_event;                  // posted for a paddle or text on any keyer
+
+static int running;
+
+// one keyer, its paddles and key output, and sidetone id
+typedef struct {
+    keyer_t keyer;
+    int id;
+    int left_gpio, right_gpio, out_gpio;
+    int ptt_gpio;               // -1 for none
+    int out_handle, ptt_handle; // their lines on the GPIO character device
+    int mark;                   // ticks the sidetone times itself for, 0 if it's waiting for the key up
+    int keyer_out;
+    atomic_int wake;            // paddle events since the engine last started it
+    unsigned control_seen;
+
+    // debounce, the level the keyer has for each paddle and the one last seen
+    keyer_debounce_t paddle[2];
+
+    // tick of the paddle edge the next key down answers, for the latency stats
+    uint32_t edge_tick;
+    atomic_int edge_pending;
+
+    // absolute deadline engine
+    uint64_t deadline;          // ns, when the keyer is next due
+    int hold;                   // ticks it runs up to then
+} station_t;
+
+static station_t stations[MAX_KEYERS];
+static int nstations = 0;
+
+// message memory buttons given with -F, memory i is on buttons[i]
+typedef struct {
+    int gpio;
+    int state;
+    uint32_t tick;              // of the last press
+} button_t;
+
+static button_t buttons[MEMORY_MAX];
+static int nbuttons = 0;
+
+// pigpio, or the GPIO character device
+static uint32_t gpio_tick() {
+    return gpio_chip ? gpio_cdev_tick() : gpioTick();
+}
 
-void keyer_update() {
-    dot_delay = 1200 / cw_keyer_speed;
-    // will be 3 * dot length at standard weight
-    dash_delay = (dot_delay * 3 * cw_keyer_weight) / 50;
+static void gpio_write(int gpio, int handle, int value) {
+    if (gpio_chip)
+        gpio_cdev_write(handle, value);
+    else
+        gpioWrite(gpio, value);
+}
 
-    if (cw_keys_reversed) {
-        kdot = &kcwr;
-        kdash = &kcwl;
-    } else {
-        kdot = &kcwl;
-        kdash = &kcwr;
-    }
+// one shot, 0 to cancel, both call back with PI_TIMEOUT
+static void gpio_watchdog(int gpio, uint32_t us) {
+    if (gpio_chip)
+        gpio_cdev_watchdog(gpio, us);
+    else
+        gpioSetWatchdog(gpio, (us + 999) / 1000);
 }
 
-void keyer_event(int gpio, int level, uint32_t tick) {
+static void paddle_edge(station_t *s, int right, int state, uint32_t tick);
+
+// An edge within the hold-off of the paddle's last change is contact
+// bounce and goes no further, not even a wakeup.  A paddle doesn't always
+// end up back where it started, a tap or a spike shorter than the
+// hold-off doesn't, so the watchdog calls back when the hold-off ends and
+// whatever level was seen last is applied then.
+void keyer_event(int gpio, int level, uint32_t tick, void *arg) {
+    station_t *s = arg;
+    int right = (gpio == s->right_gpio);
     int state = (cw_active_state == 0) ? (level == 0) : (level != 0);
+    keyer_debounce_t *d = &s->paddle[right];
+    uint32_t wait;
+    int r;
+
+    if (level == PI_TIMEOUT) {
+        gpio_watchdog(gpio, 0);
+        r = keyer_debounce_settle(d, tick, debounce_make_us, debounce_break_us, &wait);
+    }
+    else {
+        r = keyer_debounce_edge(d, state, tick, debounce_make_us, debounce_break_us, &wait);
+        if (r < 0)
+            atomic_fetch_add_explicit(d->state ? &keyer_stats->bounce_make : &keyer_stats->bounce_break,
+                                      1, memory_order_relaxed);
+    }
+    if (r < 0)
+        gpio_watchdog(gpio, wait);
+    if (r <= 0)
+        return;
+    state = d->state;
+    tick = d->tick;
+    journal_write(right ? JOURNAL_RIGHT : JOURNAL_LEFT, s->id, state, s->keyer.speed, tick, 0);
+
+    // as the keyer will see it, so the far one needn't be reversed too
+    if (remote_port && remote_what == REMOTE_PADDLE)
+        remote_send(s->id, REMOTE_PADDLE, right != (s->keyer.reversed != 0), state, tick);
+    paddle_edge(s, right, state, tick);
+}
 
-    if (gpio == LEFT_PADDLE_GPIO)
-        kcwl = state;
-    else  // RIGHT_PADDLE_GPIO
-        kcwr = state;
+// A paddle edge that got past the debounce, from here or the network.
+static void paddle_edge(station_t *s, int right, int state, uint32_t tick) {
+    keyer_paddle(&s->keyer, right, state);
 
-    if (state || cw_keyer_mode == KEYER_STRAIGHT)
+    if (state || s->keyer.mode == KEYER_STRAIGHT) {
+        // only time edges the keyer can answer straight away, not memories
+        if (keyer_idle(&s->keyer) || s->keyer.mode == KEYER_STRAIGHT) {
+            s->edge_tick = tick;
+            atomic_store_explicit(&s->edge_pending, 1, memory_order_release);
+        }
+        atomic_fetch_add_explicit(&s->wake, 1, memory_order_release);
         sem_post(&cw_event);
+    }
 }
 
-void clear_memory() {
-    dot_memory  = 0;
-    dash_memory = 0;
+// An edge from the far end, on time as the jitter buffer plays it.  Key
+// edges come in on the manual lever of a keyer in straight mode, the
+// dash paddle, so they keep their length, and the PTT and the stats
+// work as they do for a local straight key.
+static void remote_edge(int id, int what, int right, int state, void *arg) {
+    station_t *s;
+
+    if (id >= nstations || what != listen_what)
+        return;
+    s = &stations[id];
+    if (what == REMOTE_KEY)
+        right = !s->keyer.reversed;
+    paddle_edge(s, right, state, gpio_tick());
 }
 
-void set_keyer_out(int state) {
-    if (keyer_out != state) {
-        keyer_out = state;
+// A memory button sends its message on the first keyer, which takes it
+// at its next element boundary, or, idle, on its next tick.  memory.c has
+// already compiled it, so all that's handed over is a pointer.
+void button_event(int gpio, int level, uint32_t tick, void *arg) {
+    button_t *b = arg;
+    station_t *s = &stations[0];
+    int state = (cw_active_state == 0) ? (level == 0) : (level != 0);
+
+    if (state == b->state)
+        return;
+    b->state = state;
+    if (!state || tick - b->tick < BUTTON_HOLDOFF_US)
+        return;
+    b->tick = tick;
+
+    memory_send(&s->keyer, b - buttons);
+    atomic_fetch_add_explicit(&s->wake, 1, memory_order_release);
+    sem_post(&cw_event);
+}
+
+void set_keyer_out(void *arg, int state) {
+    station_t *s = arg;
+
+    if (s->keyer_out != state) {
+        // on the audio clock the edge belongs pos ticks into the period
+        uint32_t tick = gpio_tick() + (cw_keyer_timing == KEYER_TIMING_AUDIO ?
+                        (uint64_t)s->keyer.pos * 1000000 / keyer_get_tick_rate(&s->keyer) : 0);
+
+        s->keyer_out = state;
+        if (remote_port && remote_what == REMOTE_KEY)
+            remote_send(s->id, REMOTE_KEY, 0, state, tick);
+        journal_write(JOURNAL_KEY, s->id, state, s->keyer.speed, tick, 0);
 
         if (state) {
-            gpioWrite(KEYER_OUT_GPIO, 1);
+            gpio_write(s->out_gpio, s->out_handle, 1);
+            if (atomic_exchange_explicit(&s->edge_pending, 0, memory_order_acquire)) {
+                uint32_t us = gpio_tick() - s->edge_tick;
+                latency_record(&keyer_stats->paddle_to_gpio, us);
+                atomic_store_explicit(&keyer_stats->pending_us, us, memory_order_relaxed);
+            }
+            // the keyer knows how long most elements last, the sidetone
+            // can shape the whole of them from the key down
+            s->mark = keyer_mark(&s->keyer);
             if (SIDETONE_GPIO)
                 softToneWrite (SIDETONE_GPIO, cw_keyer_sidetone_frequency);
+            else if (s->mark > 0 && cw_keyer_timing == KEYER_TIMING_AUDIO)
+                keyed_tone_key_for_at(s->id, 1, s->mark, keyer_get_tick_rate(&s->keyer), s->keyer.pos);
+            else if (s->mark > 0)
+                keyed_tone_key_for(s->id, 1, s->mark, keyer_get_tick_rate(&s->keyer));
+            else if (cw_keyer_timing == KEYER_TIMING_AUDIO)
+                keyed_tone_key_at(s->id, 1, s->keyer.pos);
             else
-                keyed_tone_mute = 2;
+                keyed_tone_key(s->id, 1);
         }
         else {
-            gpioWrite(KEYER_OUT_GPIO, 0);
+            gpio_write(s->out_gpio, s->out_handle, 0);
+            if (keyer_mark(&s->keyer) < 0)
+                s->mark = 0;    // cut short, the sidetone has to follow
             if (SIDETONE_GPIO)
                 softToneWrite (SIDETONE_GPIO, 0);
+            else if (s->mark > 0 && cw_keyer_timing == KEYER_TIMING_AUDIO)
+                keyed_tone_key_for_at(s->id, 0, s->mark, keyer_get_tick_rate(&s->keyer), s->keyer.pos);
+            else if (s->mark > 0)
+                keyed_tone_key_for(s->id, 0, s->mark, keyer_get_tick_rate(&s->keyer));
+            else if (cw_keyer_timing == KEYER_TIMING_AUDIO)
+                keyed_tone_key_at(s->id, 0, s->keyer.pos);
             else
-                keyed_tone_mute = 1;
+                keyed_tone_key(s->id, 0);
         }
     }
 }
 
-static void* keyer_thread(void *arg) {
-    int pos;
-    struct timespec loop_delay;
-    int interval = 1000000; // 1 ms
+// keyer PTT hook, the lead and tail are the keyer's
+static void set_ptt_out(void *arg, int state) {
+    station_t *s = arg;
 
-    while(running) {
-        sem_wait(&cw_event);
-        key_state = CHECK;
-
-        while (key_state != EXITLOOP) {
-            switch(key_state) {
-            case CHECK: // check for key press
-                if (cw_keyer_mode == KEYER_STRAIGHT) {       // Straight/External key or bug
-                    if (*kdash) {                  // send manual dashes
-                        set_keyer_out(1);
-                        key_state = EXITLOOP;
-                    }
-                    else if (*kdot)                // and automatic dots
-                        key_state = PREDOT;
-                    else {
-                        set_keyer_out(0);
-                        key_state = EXITLOOP;
-                    }
-                }
-                else {
-                    if (*kdot)
-                        key_state = PREDOT;
-                    else if (*kdash)
-                        key_state = PREDASH;
-                    else {
-                        set_keyer_out(0);
-                        key_state = EXITLOOP;
-                    }
-                }
-                break;
-            case PREDOT:                         // need to clear any pending dots or dashes
-                clear_memory();
-                key_state = SENDDOT;
-                break;
-            case PREDASH:
-                clear_memory();
-                key_state = SENDDASH;
-                break;
+    gpio_write(s->ptt_gpio, s->ptt_handle, state);
+}
 
-            // dot paddle  pressed so set keyer_out high for time dependant on speed
-            // also check if dash paddle is pressed during this time
-            case SENDDOT:
-                set_keyer_out(1);
-                if (kdelay == dot_delay) {
-                    kdelay = 0;
-                    set_keyer_out(0);
-                    key_state = DOTDELAY;        // add inter-character spacing of one dot length
-                }
-                else kdelay++;
-
-                // if Mode A and both paddels are relesed then clear dash memory
-                if (cw_keyer_mode == KEYER_MODE_A)
-                    if (!*kdot & !*kdash)
-                        dash_memory = 0;
-                    else if (*kdash)                   // set dash memory
-                        dash_memory = 1;
-                break;
-
-            // dash paddle pressed so set keyer_out high for time dependant on 3 x dot delay and weight
-            // also check if dot paddle is pressed during this time
-            case SENDDASH:
-                set_keyer_out(1);
-                if (kdelay == dash_delay) {
-                    kdelay = 0;
-                    set_keyer_out(0);
-                    key_state = DASHDELAY;       // add inter-character spacing of one dot length
-                }
-                else kdelay++;
-
-                // if Mode A and both padles are relesed then clear dot memory
-                if (cw_keyer_mode == KEYER_MODE_A)
-                    if (!*kdot & !*kdash)
-                        dot_memory = 0;
-                    else if (*kdot)                    // set dot memory
-                        dot_memory = 1;
-                break;
-
-            // add dot delay at end of the dot and check for dash memory, then check if paddle still held
-            case DOTDELAY:
-                if (kdelay == dot_delay) {
-                    kdelay = 0;
-                    if(!*kdot && cw_keyer_mode == KEYER_STRAIGHT)   // just return if in bug mode
-                        key_state = EXITLOOP;
-                    else if (dash_memory)                 // dash has been set during the dot so service
-                        key_state = PREDASH;
-                    else key_state = DOTHELD;             // dot is still active so service
-                }
-                else kdelay++;
+// tell the sidetone the dot and dash this keyer sends now, for its cache
+static void set_elements(station_t *s) {
+    if (!SIDETONE_GPIO)
+        keyed_tone_set_elements(s->id, keyer_dot_ticks(&s->keyer), keyer_dash_ticks(&s->keyer),
+                                keyer_get_tick_rate(&s->keyer));
+}
 
-                if (*kdash)                                 // set dash memory
-                    dash_memory = 1;
-                break;
+// keyer boundary hook, picks up parameters published by the control
+// thread.  Runs in the keyer engine, so only copies and arithmetic.
+// Every keyer follows the same set, each when it gets to a boundary.
+static void control_apply(void *arg) {
+    station_t *s = arg;
+    keyer_params_t p;
+
+    if (!control_fetch(&s->control_seen, &p))
+        return;
+    s->keyer.speed = p.speed;
+    s->keyer.weight = p.weight;
+    s->keyer.mode = (listen_port && listen_what == REMOTE_KEY) ? KEYER_STRAIGHT : p.mode;
+    s->keyer.spacing = p.spacing;
+    s->keyer.reversed = p.reversed;
+    s->keyer.breakin = p.breakin;
+    keyer_update(&s->keyer);
+    set_elements(s);
+
+    if (s->id == 0) {
+        cw_keyer_sidetone_frequency = p.freq;
+        cw_keyer_sidetone_gain = p.gain;
+    }
+    if (!SIDETONE_GPIO)
+        keyed_tone_set(s->id, p.gain, p.freq);
+}
 
-            // add dot delay at end of the dash and check for dot memory, then check if paddle still held
-            case DASHDELAY:
-                if (kdelay == dot_delay) {
-                    kdelay = 0;
+// touch the stack we're going to use so it's already mapped and locked
+// before the first element
+static void prefault_stack() {
+    volatile char stack[KEYER_STACK_PREFAULT];
+    int i;
 
-                    if (dot_memory)                       // dot has been set during the dash so service
-                        key_state = PREDOT;
-                    else key_state = DASHHELD;            // dash is still active so service
-                }
-                else kdelay++;
+    for (i = 0; i < KEYER_STACK_PREFAULT; i += 4096)
+        stack[i] = 0;
+}
 
-                if (*kdot)                                  // set dot memory
-                    dot_memory = 1;
-                break;
+// start an idle keyer with paddle events waiting, returns whether it did
+static int station_wake(station_t *s) {
+    if (!keyer_idle(&s->keyer) ||
+        atomic_exchange_explicit(&s->wake, 0, memory_order_acquire) == 0)
+        return 0;
+    keyer_start(&s->keyer);
+    return 1;
+}
 
-            // check if dot paddle is still held, if so repeat the dot. Else check if Letter space is required
-            case DOTHELD:
-                if (*kdot)                                  // dot has been set during the dash so service
-                    key_state = PREDOT;
-                else if (*kdash)                            // has dash paddle been pressed
-                    key_state = PREDASH;
-                else if (cw_keyer_spacing) {    // Letter space enabled so clear any pending dots or dashes
-                    clear_memory();
-                    key_state = LETTERSPACE;
-                }
-                else key_state = EXITLOOP;
-                break;
-
-            // check if dash paddle is still held, if so repeat the dash. Else check if Letter space is required
-            case DASHHELD:
-                if (*kdash)                   // dash has been set during the dot so service
-                    key_state = PREDASH;
-                else if (*kdot)               // has dot paddle been pressed
-                    key_state = PREDOT;
-                else if (cw_keyer_spacing) {    // Letter space enabled so clear any pending dots or dashes
-                    clear_memory();
-                    key_state = LETTERSPACE;
-                }
-                else key_state = EXITLOOP;
-                break;
-
-            // Add letter space (3 x dot delay) to end of character and check if a paddle is pressed during this time.
-            // Actually add 2 x dot_delay since we already have a dot delay at the end of the character.
-            case LETTERSPACE:
-                if (kdelay == 2 * dot_delay) {
-                    kdelay = 0;
-                    if (dot_memory)         // check if a dot or dash paddle was pressed during the delay.
-                        key_state = PREDOT;
-                    else if (dash_memory)
-                        key_state = PREDASH;
-                    else key_state = EXITLOOP;   // no memories set so restart
-                }
-                else kdelay++;
+// 1 ms sleep loop engine, every keyer moves a tick each loop
+static void* keyer_thread(void *arg) {
+    struct timespec loop_delay;
+    int interval = 1000000; // 1 ms
+    int i, active;
 
-                // save any key presses during the letter space delay
-                if (*kdot) dot_memory = 1;
-                if (*kdash) dash_memory = 1;
-                break;
+    if (lock_memory)
+        prefault_stack();
 
-            default:
-                key_state = EXITLOOP;
+    while(running) {
+        sem_wait(&cw_event);
 
+        do {
+            active = 0;
+            for (i = 0; i < nstations; i++) {
+                station_wake(&stations[i]);
+                if (!keyer_idle(&stations[i].keyer)) {
+                    keyer_tick(&stations[i].keyer);
+                    active = 1;
+                }
             }
+            if (!active)
+                break;
 
             clock_gettime(CLOCK_MONOTONIC, &loop_delay);
             loop_delay.tv_nsec += interval;
@@ -362,8 +463,213 @@ static void* keyer_thread(void *arg) {
                 loop_delay.tv_sec++;
             }
             clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &loop_delay, NULL);
+        } while (running);
+    }
+    return NULL;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+// absolute deadline engine.  One tick is a microsecond and every wakeup
+// is accumulated from the time the paddle woke the keyer, so scheduling
+// latency never builds up across elements.  The paddles are still polled
+// every KEYER_POLL_US whilst an element runs, for the dot and dash memories.
+// The keyers share the thread, which sleeps until the earliest deadline
+// or a paddle, whichever comes first.
+static void* keyer_precise_thread(void *arg) {
+    struct timespec wait;
+    uint64_t now, next;
+    station_t *s;
+    int i;
+
+    if (lock_memory)
+        prefault_stack();
+
+    while(running) {
+        next = UINT64_MAX;
+        for (i = 0; i < nstations; i++)
+            if (!keyer_idle(&stations[i].keyer) && stations[i].deadline < next)
+                next = stations[i].deadline;
+
+        if (next == UINT64_MAX)
+            sem_wait(&cw_event);
+        else {
+            wait.tv_sec = next / NSEC_PER_SEC;
+            wait.tv_nsec = next % NSEC_PER_SEC;
+            sem_clockwait(&cw_event, CLOCK_MONOTONIC, &wait);
+        }
+
+        now = monotonic_ns();
+        for (i = 0; i < nstations; i++) {
+            s = &stations[i];
+            if (station_wake(s)) {
+                s->keyer.pos = 0;
+                s->deadline = now;
+            }
+            else if (keyer_idle(&s->keyer) || s->deadline > now)
+                continue;
+
+            keyer_run(&s->keyer, 0);
+            if (!keyer_idle(&s->keyer)) {
+                s->hold = keyer_hold(&s->keyer);
+                if (s->hold > KEYER_POLL_US && keyer_polling(&s->keyer))
+                    s->hold = KEYER_POLL_US;
+                keyer_run(&s->keyer, s->hold);
+                s->deadline += (uint64_t)s->hold * 1000;
+            }
+        }
+    }
+    return NULL;
+}
+
+// audio clock engine, called by process() at the start of every JACK
+// cycle.  One tick is one sample, so element lengths are exact multiples
+// of the sample period and keyer transitions land on the frame they
+// belong to.
+static void keyer_clock(unsigned nframes, unsigned sample_rate) {
+    station_t *s;
+    int i;
+
+    // the keyers are woken by their own flags, nothing waits on this here
+    while (sem_trywait(&cw_event) == 0)
+        ;
+
+    for (i = 0; i < nstations; i++) {
+        s = &stations[i];
+        if (keyer_idle(&s->keyer) && keyer_get_tick_rate(&s->keyer) != sample_rate) {
+            keyer_set_clock(&s->keyer, sample_rate, 1);
+            keyer_update(&s->keyer);
+            set_elements(s);
+        }
+
+        s->keyer.pos = 0;
+        while (s->keyer.pos < nframes) {
+            if (keyer_idle(&s->keyer) && !station_wake(s))
+                break;
+            keyer_run(&s->keyer, nframes - s->keyer.pos);
+        }
+    }
+}
+
+// sends the text on stdin with the first keyer.  Each character's elements
+// are looked up already timed for the current speed, and queued for
+// whichever engine runs the keyer; the queue only blocks us, never the keyer.
+static void* text_thread(void *arg) {
+    station_t *s = &stations[0];
+    const morse_char_t *m;
+    int c, k, speed = 0, weight = 0;
+
+    while ((c = fgetc(stdin)) != EOF && running) {
+        if (speed != s->keyer.speed || weight != s->keyer.weight) {
+            speed = s->keyer.speed;
+            weight = s->keyer.weight;
+            morse_update(speed, weight);
+        }
+        m = morse_lookup(c);
+        for (k = 0; k < m->n; k++)
+            while (keyer_text_push(&s->keyer, m->mark[k], m->space[k]) < 0)
+                usleep(10000);
+        if (m->n) {
+            atomic_fetch_add_explicit(&s->wake, 1, memory_order_release);
+            sem_post(&cw_event);
+        }
+    }
+    return NULL;
+}
+
+static int set_cpu(pthread_t thread, int cpu) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+}
+
+// report each real-time step as it goes, none of them are fatal
+static void rt_setup_process() {
+    if (lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+            // keep freed memory and large blocks in the locked heap
+            mallopt(M_TRIM_THRESHOLD, -1);
+            mallopt(M_MMAP_MAX, 0);
+            printf("rt: memory locked\n");
         }
+        else printf("rt: mlockall failed: %s\n", strerror(errno));
+    }
+}
+
+// The GPIO threads inherit main's affinity when they're created, so main
+// is pinned just for that, pin 1 before and 0 after, and every other
+// thread it starts, JACK's and ALSA's included, stays where it was.
+static void rt_gpio_cpu(int pin) {
+    int err;
+
+    if (gpio_cpu < 0)
+        return;
+    if (!pin) {
+        pthread_setaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus);
+        return;
+    }
+    pthread_getaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus);
+    err = set_cpu(pthread_self(), gpio_cpu);
+    if (err == 0)
+        printf("rt: gpio threads on cpu %d\n", gpio_cpu);
+    else printf("rt: gpio threads on cpu %d failed: %s\n", gpio_cpu, strerror(err));
+}
+
+static void rt_setup_keyer(pthread_t thread) {
+    struct sched_param param;
+    int err;
+
+    if (keyer_rt_priority > 0) {
+        param.sched_priority = keyer_rt_priority;
+        err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (err == 0)
+            printf("rt: keyer thread SCHED_FIFO priority %d\n", keyer_rt_priority);
+        else printf("rt: keyer thread SCHED_FIFO priority %d failed: %s\n", keyer_rt_priority, strerror(err));
+    }
+
+    if (keyer_cpu >= 0) {
+        err = set_cpu(thread, keyer_cpu);
+        if (err == 0)
+            printf("rt: keyer thread on cpu %d\n", keyer_cpu);
+        else printf("rt: keyer thread on cpu %d failed: %s\n", keyer_cpu, strerror(err));
+    }
+}
+
+// the settings file again, over the settings as they are now.  The
+// keyers pick them up at their next boundaries, the GPIO and the audio
+// stay as they are.
+static void settings_reload() {
+    keyer_params_t p;
+
+    control_current(&p);
+    if (control_load(settings_file, &p) < 0) {
+        fprintf(stderr, "settings: %s not reloaded\n", settings_file);
+        return;
     }
+    control_publish(&p);
+    printf("settings: reloaded %s\n", settings_file);
+}
+
+// dumps the stats on SIGUSR1 and reloads the settings on SIGHUP, which
+// every other thread has blocked
+static void* stats_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0) {
+        if (sig == SIGHUP)
+            settings_reload();
+        else
+            keyer_stats_dump(stdout);
+    }
+    return NULL;
 }
 
 void sig_handler(int sig) {
@@ -371,10 +677,29 @@ void sig_handler(int sig) {
     sem_post(&cw_event);
 }
 
+static void station_add(int left, int right, int out, int ptt) {
+    station_t *s;
+
+    if (nstations == MAX_KEYERS) {
+        fprintf(stderr, "at most %d keyers\n", MAX_KEYERS);
+        exit(1);
+    }
+    s = &stations[nstations];
+    s->id = nstations++;
+    s->left_gpio = left;
+    s->right_gpio = right;
+    s->out_gpio = out;
+    s->ptt_gpio = ptt;
+}
+
 int main (int argc, char **argv) {
-    int i;
+    int i, n, left, right, out, ptt;
     char snd_dev[64]="hw:0";
-    struct sched_param param;
+    static sigset_t usr1;
+    keyer_params_t params;
+    char error[64];
+    uint32_t pulls;
+    station_t *s;
 
     for (i = 1; i < argc; i++)
         if (argv[i][0] == '-')
@@ -382,12 +707,33 @@ int main (int argc, char **argv) {
             case 'a':
                 cw_active_state = atoi(argv[++i]);
                 break;
+            case 'b':
+                cw_keyer_breakin = atoi(argv[++i]);
+                break;
+            case 'B':
+                sidetone_backend = atoi(argv[++i]);
+                break;
             case 'c':
                 cw_keyer_spacing = atoi(argv[++i]);
                 break;
+            case 'C':
+                jack_connect_regex = argv[++i];
+                break;
             case 'd':
                 strcpy(snd_dev, argv[++i]);
                 break;
+            case 'D':
+                switch (sscanf(argv[++i], "%d,%d", &debounce_make_us, &debounce_break_us)) {
+                case 1:
+                    debounce_break_us = debounce_make_us;
+                    break;
+                case 2:
+                    break;
+                default:
+                    fprintf(stderr, "-D wants make_us[,break_us], not %s\n", argv[i]);
+                    exit(1);
+                }
+                break;
             case 'e': /* envelope in milliseconds */
                 cw_keyer_sidetone_envelope = atoi(argv[++i]);
                 printf("E: %d\n", cw_keyer_sidetone_envelope);
@@ -395,56 +741,287 @@ int main (int argc, char **argv) {
             case 'f':
                 cw_keyer_sidetone_frequency = atoi(argv[++i]);
                 break;
+            case 'F':
+                n = 0;
+                if (nbuttons == MEMORY_MAX || sscanf(argv[++i], "%d,%n", &buttons[nbuttons].gpio, &n) != 1 ||
+                    n == 0) {
+                    fprintf(stderr, "-F wants gpio,message, at most %d of them, not %s\n", MEMORY_MAX, argv[i]);
+                    exit(1);
+                }
+                if (memory_store(nbuttons, argv[i] + n) < 0) {
+                    fprintf(stderr, "-F message too long: %s\n", argv[i] + n);
+                    exit(1);
+                }
+                nbuttons++;
+                break;
             case 'g':/* gain in dB */
                 cw_keyer_sidetone_gain = atoi(argv[++i]);
                 break;
+            case 'i':
+                gpio_chip = argv[++i];
+                break;
+            case 'J':
+                if (sscanf(argv[++i], "%255[^,],%u", journal_file, &journal_records) < 1) {
+                    fprintf(stderr, "-J wants file[,records], not %s\n", argv[i]);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                listen_depth_ms = atoi(argv[++i]);
+                break;
+            case 'k':
+                keyer_cpu = atoi(argv[++i]);
+                break;
+            case 'K':
+                gpio_cpu = atoi(argv[++i]);
+                break;
+            case 'l':
+                lock_memory = atoi(argv[++i]);
+                break;
+            case 'L':
+                if (sscanf(argv[++i], "%d,%d", &listen_port, &listen_what) < 1) {
+                    fprintf(stderr, "-L wants port[,edges], not %s\n", argv[i]);
+                    exit(1);
+                }
+                break;
             case 'm':
                 cw_keyer_mode = atoi(argv[++i]);
                 break;
+            case 'M':
+                midi_note = atoi(argv[++i]);
+                break;
+            case 'n':
+                audio_period = atoi(argv[++i]);
+                break;
+            case 'N':
+                if (memory_set_serial(atoi(argv[++i])) < 0) {
+                    fprintf(stderr, "-N wants a serial number from 0 to 999999999, not %s\n", argv[i]);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                jack_channels = atoi(argv[++i]);
+                break;
+            case 'p':
+                ptt = -1;
+                if (sscanf(argv[++i], "%d,%d,%d,%d", &left, &right, &out, &ptt) < 3) {
+                    fprintf(stderr, "-p wants left,right,out[,ptt] GPIOs, not %s\n", argv[i]);
+                    exit(1);
+                }
+                station_add(left, right, out, ptt);
+                break;
+            case 'P':
+                if (sscanf(argv[++i], "%d,%d", &ptt_lead_ms, &ptt_tail_ms) != 2) {
+                    fprintf(stderr, "-P wants lead_ms,tail_ms, not %s\n", argv[i]);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                keyer_rt_priority = atoi(argv[++i]);
+                break;
+            case 'R':
+                if (sscanf(argv[++i], "%63[^:]:%d,%d", remote_host, &remote_port, &remote_what) < 2) {
+                    fprintf(stderr, "-R wants host:port[,edges], not %s\n", argv[i]);
+                    exit(1);
+                }
+                break;
             case 's':
                 cw_keyer_speed = atoi(argv[++i]);
                 break;
+            case 'S':
+                settings_file = argv[++i];
+                break;
+            case 't':
+                cw_keyer_timing = atoi(argv[++i]);
+                break;
+            case 'u':
+                if (strchr(argv[++i], ':') == NULL)
+                    control_port = atoi(argv[i]);
+                else if (sscanf(argv[i], "%63[^:]:%d", control_host, &control_port) != 2) {
+                    fprintf(stderr, "-u wants [address:]port, not %s\n", argv[i]);
+                    exit(1);
+                }
+                break;
             case 'w':
                 cw_keyer_weight = atoi(argv[++i]);
                 break;
+            case 'x':
+                element_cache = atoi(argv[++i]);
+                break;
+            case 'y':
+                idle_ms = atoi(argv[++i]);
+                break;
+            case 'W':
+                cw_keyer_sidetone_window = window_lookup(argv[++i]);
+                if (cw_keyer_sidetone_window < 0) {
+                    fprintf(stderr, "unknown window %s, one of:", argv[i]);
+                    for (i = 0; window_names[i] != NULL; i++)
+                        fprintf(stderr, " %s", window_names[i]);
+                    fprintf(stderr, "\n");
+                    exit(1);
+                }
+                break;
             default:
                 fprintf(stderr,
                         "iambic [-a GPIO active_state (0=LOW, 1=HIGH) default is 0]\n"
+                        "       [-b paddle break-in (0=paddles wait for the text, 1=paddles abort the text)]\n"
+                        "       [-B sidetone backend (0=JACK, 1=ALSA mmap on the -d device)]\n"
                         "       [-c strict_char_spacing (0=off, 1=on)]\n"
-                        "       [-d sound device string (default is hw:0)]\n"
+                        "       [-C regex of JACK playback ports to connect (default is the physical ones)]\n"
+                        "       [-d ALSA sound device string (default is hw:0)]\n"
+                        "       [-D paddle debounce hold-off in us after a make[,after a break] (default is 0, off)]\n"
                         "       [-e sidetone start/end ramp envelope in ms (default is 5)]\n"
                         "       [-f sidetone_freq_hz] [-g sidetone gain in dB]\n"
+                        "       [-F gpio,message of a memory button, # for the serial number, once per button]\n"
+                        "       [-i GPIO character device for the paddles and key instead of pigpio, e.g. /dev/gpiochip0]\n"
+                        "       [-j least remote jitter buffer in ms (default is 20)]\n"
+                        "       [-J file[,records] event journal ring (default is %d records)]\n"
+                        "       [-k keyer thread cpu] [-K gpio threads cpu]\n"
+                        "       [-l lock memory (0=off, 1=on)]\n"
+                        "       [-L port[,edges] to play remote edges from (0=paddles, 1=key)]\n"
                         "       [-m mode (0=straight or bug, 1=iambic_a, 2=iambic_b)]\n"
-                        "       [-s speed_wpm] [-w weight (33-66)]\n");
+                        "       [-M JACK MIDI key output note (0-127, default is no MIDI port)]\n"
+                        "       [-n audio period in frames (default is the JACK server's, or 64 for ALSA)]\n"
+                        "       [-N first serial number (default is 1)]\n"
+                        "       [-o JACK sidetone output ports (default is 1)]\n"
+                        "       [-p left,right,out[,ptt] GPIOs of a keyer, once per keyer (default is one on %d,%d,%d)]\n"
+                        "       [-P PTT lead_ms,tail_ms (default is 10,100)]\n"
+                        "       [-r keyer thread SCHED_FIFO priority (0=off)]\n"
+                        "       [-R host:port[,edges] to send the edges to (0=paddles, 1=key)]\n"
+                        "       [-s speed_wpm] [-w weight (33-66)]\n"
+                        "       [-S settings file of name value pairs as -u takes them, read again on SIGHUP]\n"
+                        "       [-W sidetone ramp window (default is blackman-harris)]\n"
+                        "       [-x pre-rendered dot and dash sidetone (0=off, 1=on)]\n"
+                        "       [-y ms of silence before the sidetone idles (default is 0, never)]\n"
+                        "       [-t timing (0=1ms sleep loop, 1=JACK audio clock, 2=absolute us deadlines)]\n"
+                        "       [-u [address:]UDP control port (0=off), unauthenticated, so the loopback only\n"
+                        "           unless an address is given, e.g. 0.0.0.0:7355 for every interface]\n"
+                        "       [text file, default is stdin]\n",
+                        JOURNAL_RECORDS, LEFT_PADDLE_GPIO, RIGHT_PADDLE_GPIO, KEYER_OUT_GPIO);
                 exit(1);
             }
         else break;
 
+    if (cw_keyer_timing == KEYER_TIMING_AUDIO && SIDETONE_GPIO) {
+        fprintf(stderr, "the audio clock timing needs the JACK sidetone\n");
+        exit(1);
+    }
+    if (nstations == 0)
+        station_add(LEFT_PADDLE_GPIO, RIGHT_PADDLE_GPIO, KEYER_OUT_GPIO, PTT_GPIO);
+
     if (i < argc) {
         if (!freopen(argv[i], "r", stdin))
             perror(argv[i]), exit(1);
         i++;
     }
 
-    if(gpioInitialise()<0) {
-        fprintf(stderr,"Cannot initialize GPIO\n");
-        return -1;
+    params = (keyer_params_t){
+        cw_keyer_speed, cw_keyer_weight, cw_keyer_mode, cw_keyer_spacing,
+        cw_keys_reversed, cw_keyer_breakin, cw_keyer_sidetone_frequency, cw_keyer_sidetone_gain
+    };
+    // -u and SIGHUP check every change against the whole set
+    if ((control_port || settings_file) && control_parse("", &params, error, sizeof(error)) < 0) {
+        fprintf(stderr, "-u and -S can't change settings outside their ranges, see control.c\n");
+        exit(1);
     }
+    if (settings_file) {
+        if (control_load(settings_file, &params) < 0)
+            exit(1);
+        cw_keyer_speed = params.speed;
+        cw_keyer_weight = params.weight;
+        cw_keyer_mode = params.mode;
+        cw_keyer_spacing = params.spacing;
+        cw_keys_reversed = params.reversed;
+        cw_keyer_breakin = params.breakin;
+        cw_keyer_sidetone_frequency = params.freq;
+        cw_keyer_sidetone_gain = params.gain;
+    }
+    if (listen_port && listen_what == REMOTE_KEY)
+        cw_keyer_mode = KEYER_STRAIGHT;
+
+    sem_init(&cw_event, 0, 0);
+    rt_setup_process();
+
+    // before any other thread exists, so they all inherit the mask
+    keyer_stats_init();
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    sigaddset(&usr1, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    pthread_create(&stats_thread_id, NULL, stats_thread, &usr1);
+    if (journal_file[0] && journal_open(journal_file, journal_records, gpio_tick) < 0)
+        exit(1);
+
+    if (gpio_chip) {
+        if (gpio_cdev_open(gpio_chip) < 0)
+            return -1;
+    }
+    else {
+        rt_gpio_cpu(1);
+        if(gpioInitialise()<0) {
+            fprintf(stderr,"Cannot initialize GPIO\n");
+            return -1;
+        }
+        rt_gpio_cpu(0);
+    }
+
+    // the pulls first, with no alerts yet, so they can settle while the
+    // sidetone starts instead of in sleeps of their own
+    for (i = 0; i < nstations; i++) {
+        s = &stations[i];
+        keyer_init(&s->keyer, set_keyer_out, s);
+        if (cw_keyer_timing == KEYER_TIMING_PRECISE)
+            keyer_set_clock(&s->keyer, 1000000, 1);
+        s->keyer.speed = cw_keyer_speed;
+        s->keyer.weight = cw_keyer_weight;
+        s->keyer.mode = cw_keyer_mode;
+        s->keyer.spacing = cw_keyer_spacing;
+        s->keyer.reversed = cw_keys_reversed;
+        s->keyer.breakin = cw_keyer_breakin;
+        if (s->ptt_gpio >= 0)
+            keyer_set_ptt(&s->keyer, set_ptt_out, ptt_lead_ms * 1000, ptt_tail_ms * 1000);
+        keyer_update(&s->keyer);
+        set_elements(s);
+        // no hold-off for the first edges
+        s->paddle[0].tick = s->paddle[1].tick = gpio_tick() - debounce_make_us - debounce_break_us;
+        s->paddle[0].raw_tick = s->paddle[1].raw_tick = s->paddle[0].tick;
+
+        if (gpio_chip) {
+            // requested with the bias, but nothing is read until gpio_cdev_start()
+            s->out_handle = gpio_cdev_output(s->out_gpio);
+            s->ptt_handle = (s->ptt_gpio >= 0) ? gpio_cdev_output(s->ptt_gpio) : 0;
+            if (s->out_handle < 0 || s->ptt_handle < 0 ||
+                gpio_cdev_input(s->left_gpio, s->right_gpio, keyer_event, s) < 0)
+                return -1;
+            continue;
+        }
 
-    gpioSetMode(RIGHT_PADDLE_GPIO, PI_INPUT);
-    gpioSetPullUpDown(RIGHT_PADDLE_GPIO,PI_PUD_UP);
-    usleep(100000);
-    gpioSetAlertFunc(RIGHT_PADDLE_GPIO, keyer_event);
-    gpioSetMode(LEFT_PADDLE_GPIO, PI_INPUT);
-    gpioSetPullUpDown(LEFT_PADDLE_GPIO,PI_PUD_UP);
-    usleep(100000);
-    gpioSetAlertFunc(LEFT_PADDLE_GPIO, keyer_event);
-    gpioSetMode(KEYER_OUT_GPIO, PI_OUTPUT);
-    gpioWrite(KEYER_OUT_GPIO, 0);
+        gpioSetMode(s->right_gpio, PI_INPUT);
+        gpioSetPullUpDown(s->right_gpio,PI_PUD_UP);
+        gpioSetMode(s->left_gpio, PI_INPUT);
+        gpioSetPullUpDown(s->left_gpio,PI_PUD_UP);
+        gpioSetMode(s->out_gpio, PI_OUTPUT);
+        gpioWrite(s->out_gpio, 0);
+        if (s->ptt_gpio >= 0) {
+            gpioSetMode(s->ptt_gpio, PI_OUTPUT);
+            gpioWrite(s->ptt_gpio, 0);
+        }
+    }
 
-    keyer_update();
+    for (i = 0; i < nbuttons; i++) {
+        buttons[i].tick = gpio_tick() - BUTTON_HOLDOFF_US;
+        if (gpio_chip) {
+            if (gpio_cdev_button(buttons[i].gpio, button_event, &buttons[i]) < 0)
+                return -1;
+            continue;
+        }
+        gpioSetMode(buttons[i].gpio, PI_INPUT);
+        gpioSetPullUpDown(buttons[i].gpio, PI_PUD_UP);
+    }
+    pulls = gpio_tick();
 
-    if (wiringPiSetup () < 0) {
+    // only the softTone sidetone needs wiringPi
+    if (SIDETONE_GPIO && wiringPiSetup () < 0) {
         printf ("Unable to setup wiringPi: %s\n", strerror (errno));
         return 1;
     }
@@ -452,25 +1029,97 @@ int main (int argc, char **argv) {
     if (SIDETONE_GPIO)
         softToneCreate(SIDETONE_GPIO);
     else {
-        i = keyed_tone_start(cw_keyer_sidetone_gain, cw_keyer_sidetone_frequency, cw_keyer_sidetone_envelope);
-        if(i < 0) {
+        if (cw_keyer_timing == KEYER_TIMING_AUDIO)
+            keyed_tone_set_clock(keyer_clock);
+        keyed_tone_set_tones(nstations);
+        keyed_tone_set_cache(element_cache);
+        keyed_tone_set_idle(idle_ms);
+        if (sidetone_backend == SIDETONE_ALSA)
+            i = alsa_tone_start(snd_dev, cw_keyer_sidetone_gain, cw_keyer_sidetone_frequency,
+                                cw_keyer_sidetone_envelope, cw_keyer_sidetone_window,
+                                audio_period, keyer_rt_priority);
+        else {
+            keyed_tone_set_period(audio_period);
+            keyed_tone_set_midi(midi_note);
+            keyed_tone_set_ports(jack_channels, jack_connect_regex);
+            i = keyed_tone_start(cw_keyer_sidetone_gain, cw_keyer_sidetone_frequency, cw_keyer_sidetone_envelope,
+                                 cw_keyer_sidetone_window);
+        }
+        if(i != 0) {
             fprintf(stderr,"keyed_tone_start failed %d\n", i);
             exit(-1);
         }
     }
 
-    i = sem_init(&cw_event, 0, 0);
+    // whatever is left of the settling, then the paddles go live
+    if (gpio_tick() - pulls < PULL_SETTLE_US)
+        usleep(PULL_SETTLE_US - (gpio_tick() - pulls));
+    if (!gpio_chip) {
+        for (i = 0; i < nstations; i++) {
+            gpioSetAlertFuncEx(stations[i].right_gpio, keyer_event, &stations[i]);
+            gpioSetAlertFuncEx(stations[i].left_gpio, keyer_event, &stations[i]);
+        }
+        for (i = 0; i < nbuttons; i++)
+            gpioSetAlertFuncEx(buttons[i].gpio, button_event, &buttons[i]);
+    }
+    else {
+        rt_gpio_cpu(1);
+        if (gpio_cdev_start() < 0)
+            return -1;
+        rt_gpio_cpu(0);
+    }
+
+    // the boundary hook takes -u changes and SIGHUP reloads alike
+    if (control_port || settings_file) {
+        control_publish(&params);
+        for (i = 0; i < nstations; i++)
+            keyer_set_boundary(&stations[i].keyer, control_apply);
+        if (control_port && control_start(control_host[0] ? control_host : NULL, control_port) < 0)
+            exit(1);
+    }
+
+    if (remote_port && remote_send_start(remote_host, remote_port, gpio_tick) < 0)
+        exit(1);
+    if (listen_port && remote_listen_start(listen_port, listen_depth_ms, remote_edge, NULL) < 0)
+        exit(1);
+
     running = 1;
-    i |= pthread_create(&keyer_thread_id, NULL, keyer_thread, NULL);
-    if(i < 0) {
+    i = 0;
+    if (cw_keyer_timing == KEYER_TIMING_SLEEP)
+        i = pthread_create(&keyer_thread_id, NULL, keyer_thread, NULL);
+    else if (cw_keyer_timing == KEYER_TIMING_PRECISE)
+        i = pthread_create(&keyer_thread_id, NULL, keyer_precise_thread, NULL);
+    if(i) {
         fprintf(stderr,"pthread_create for keyer_thread failed %d\n", i);
         exit(-1);
     }
+    if (cw_keyer_timing == KEYER_TIMING_AUDIO) {
+        if (sidetone_backend == SIDETONE_ALSA && keyer_cpu >= 0)
+            printf("rt: the audio clock keyer runs in the ALSA thread, -k ignored\n");
+        else if (sidetone_backend != SIDETONE_ALSA && (keyer_rt_priority > 0 || keyer_cpu >= 0))
+            printf("rt: the audio clock keyer runs in the JACK thread, -r and -k ignored\n");
+    }
+    else rt_setup_keyer(keyer_thread_id);
+
+    // after the real-time setup, the text reader doesn't want any of it
+    if (pthread_create(&text_thread_id, NULL, text_thread, NULL))
+        fprintf(stderr, "pthread_create for text_thread failed, no text keying\n");
 
     signal(SIGINT, sig_handler);
     signal(SIGKILL, sig_handler);
-    pthread_join(keyer_thread_id, 0);
-    keyed_tone_close();
+    if (cw_keyer_timing == KEYER_TIMING_AUDIO)
+        while (running)
+            pause();
+    else
+        pthread_join(keyer_thread_id, 0);
+    if (!SIDETONE_GPIO && sidetone_backend == SIDETONE_ALSA)
+        alsa_tone_close();
+    else if (!SIDETONE_GPIO)
+        keyed_tone_close();
+    remote_close();
+    if (gpio_chip)
+        gpio_cdev_close();
+    journal_close();
     sem_destroy(&cw_event);
 
     return 0;
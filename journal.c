@@ -0,0 +1,170 @@
+/*
+
+    keying journal, see journal.h
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include "journal.h"
+
+#define JOURNAL_MAX_IDS 8
+
+static journal_header_t *journal;	/* the ring, in shared memory */
+static journal_header_t *copy;		/* what the copy thread writes out */
+static int file_fd = -1;
+static sem_t copy_stop;
+static pthread_t copy_thread_id;
+static int copying;
+static journal_record_t *records;
+static size_t journal_size;
+static unsigned mask;
+static uint32_t (*journal_clock)(void);
+static atomic_int last_wpm[JOURNAL_MAX_IDS];
+
+/*
+** a snapshot of the ring into the copy, record by record as a reader
+** takes them, so one being written is marked invalid rather than torn,
+** and then into the file.
+*/
+static void journal_copy() {
+    journal_record_t *from = records, *to = (journal_record_t *)(copy + 1);
+    unsigned i;
+    uint32_t seq;
+
+    memcpy(copy, journal, sizeof(*copy));
+    atomic_store_explicit(&copy->head, atomic_load_explicit(&journal->head, memory_order_acquire),
+                          memory_order_relaxed);
+    for (i = 0; i <= mask; i++) {
+        seq = atomic_load_explicit(&from[i].seq, memory_order_acquire);
+        memcpy(&to[i], &from[i], sizeof(to[i]));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&from[i].seq, memory_order_relaxed) != seq)
+            atomic_store_explicit(&to[i].seq, ~0u, memory_order_relaxed);
+    }
+    if (pwrite(file_fd, copy, journal_size, 0) != (ssize_t)journal_size)
+        fprintf(stderr, "journal: write failed: %s\n", strerror(errno));
+}
+
+static void* copy_thread(void *arg) {
+    struct timespec t;
+
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += JOURNAL_COPY_S;
+        if (sem_timedwait(&copy_stop, &t) == 0)
+            break;
+        journal_copy();
+    }
+    return NULL;
+}
+
+/*
+** the ring is in shared memory, which is never written back, so a write
+** neither faults nor waits on the disk once it has been touched here.
+** the file is only ever written by the copy thread.
+*/
+int journal_open(const char *path, unsigned records_req, uint32_t (*clock)(void)) {
+    void *p = MAP_FAILED;
+    unsigned n = 1;
+    int fd;
+
+    while (n < records_req)
+        n <<= 1;
+    journal_size = sizeof(journal_header_t) + (size_t)n * sizeof(journal_record_t);
+
+    file_fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (file_fd < 0) {
+        perror(path);
+        return -1;
+    }
+    fd = shm_open(JOURNAL_SHM, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, journal_size) == 0)
+            p = mmap(NULL, journal_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    copy = malloc(journal_size);
+    if (p == MAP_FAILED || copy == NULL) {
+        fprintf(stderr, "journal: no shared memory segment %s\n", JOURNAL_SHM);
+        close(file_fd);
+        return -1;
+    }
+
+    memset(p, 0, journal_size);
+    records = (journal_record_t *)((journal_header_t *)p + 1);
+    memset(records, 0xff, (size_t)n * sizeof(journal_record_t));	/* every seq invalid */
+    mask = n - 1;
+    journal_clock = clock;
+    journal = p;
+    journal->magic = JOURNAL_MAGIC;
+    journal->version = JOURNAL_VERSION;
+    journal->records = n;
+    journal->record_size = sizeof(journal_record_t);
+
+    sem_init(&copy_stop, 0, 0);
+    if (pthread_create(&copy_thread_id, NULL, copy_thread, NULL) == 0)
+        copying = 1;
+    else
+        fprintf(stderr, "journal: pthread_create failed, %s written at exit only\n", path);
+    return 0;
+}
+
+/*
+** any number of writers, each claims the next record and fills it.  a
+** reader that finds seq other than the record's number, before or
+** after copying it, was overtaken by a writer and skips it.
+*/
+void journal_write(int source, int id, int state, int wpm, uint32_t tick, uint32_t frame) {
+    unsigned long long n;
+    journal_record_t *r;
+
+    if (journal == NULL)
+        return;
+    if (wpm)
+        atomic_store_explicit(&last_wpm[id & (JOURNAL_MAX_IDS-1)], wpm, memory_order_relaxed);
+    else
+        wpm = atomic_load_explicit(&last_wpm[id & (JOURNAL_MAX_IDS-1)], memory_order_relaxed);
+
+    n = atomic_fetch_add_explicit(&journal->head, 1, memory_order_relaxed);
+    r = &records[n & mask];
+    atomic_store_explicit(&r->seq, ~0u, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    r->tick = tick;
+    r->frame = frame;
+    r->source = source;
+    r->id = id;
+    r->state = state;
+    r->wpm = wpm;
+    atomic_store_explicit(&r->seq, (uint32_t)n, memory_order_release);
+}
+
+uint32_t journal_now() {
+    return journal ? journal_clock() : 0;
+}
+
+/*
+** the last copy, and to disk.  the ring stays mapped, a GPIO callback
+** may still be writing, but its segment goes, the file has it all.
+*/
+void journal_close() {
+    if (journal == NULL)
+        return;
+    if (copying) {
+        sem_post(&copy_stop);
+        pthread_join(copy_thread_id, NULL);
+        copying = 0;
+    }
+    journal_copy();
+    fsync(file_fd);
+    close(file_fd);
+    shm_unlink(JOURNAL_SHM);
+}
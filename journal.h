@@ -0,0 +1,62 @@
+/*
+
+    a journal of every paddle edge, keyed output edge and sidetone
+    change, for logging and timing analysis after the event.  it is a
+    ring of fixed size binary records in a shared memory segment, filled
+    in place, so a write from the GPIO, keyer or audio thread is a few
+    stores with no syscall and no page fault: shared memory is never
+    written back, so its pages stay writable.  a thread of its own
+    copies the ring to the file every JOURNAL_COPY_S seconds and at
+    exit, and after a crash the segment still has it until the next
+    start or a reboot.
+
+    the segment and the file are a journal_header_t and then records of
+    journal_record_t, records a power of two.  record n lives at
+    n & (records-1) and is valid while its seq is n, a write stores ~0
+    there first and n last.
+
+    journal_read turns either into text, or a replay trace.
+
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define JOURNAL_MAGIC 0x6b6a726e	/* "kjrn" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORDS 65536		/* the default, 1 MB of file */
+#define JOURNAL_SHM "/iambic-keyer-journal"	/* /dev/shm/iambic-keyer-journal to read it live */
+#define JOURNAL_COPY_S 1
+
+/* sources */
+#define JOURNAL_LEFT 0			/* a paddle as wired, after the debounce */
+#define JOURNAL_RIGHT 1
+#define JOURNAL_KEY 2			/* the keyed output */
+#define JOURNAL_TONE 3			/* a key event reaching the sidetone */
+
+typedef struct {
+    atomic_uint seq;
+    uint32_t tick;			/* us, on the keyer's GPIO clock */
+    uint32_t frame;			/* JOURNAL_TONE only, the audio frame it was applied at */
+    uint8_t source, id, state, wpm;	/* id of the keyer */
+} journal_record_t;
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t records, record_size;
+    atomic_ullong head;			/* records ever written */
+} journal_header_t;
+
+/* create or truncate path for records, clock is the one ticks are on, before any thread that writes */
+int journal_open(const char *path, unsigned records, uint32_t (*clock)(void));
+/* from any thread, wpm 0 for the keyer's last */
+void journal_write(int source, int id, int state, int wpm, uint32_t tick, uint32_t frame);
+/* the journal's clock now, 0 if there is no journal */
+uint32_t journal_now();
+/* the last copy to the file, writes may carry on */
+void journal_close();
+
+#endif
@@ -0,0 +1,125 @@
+/*
+
+    print a keying journal written with iambic -J, oldest record first,
+    as text, one record per line:
+
+        <microseconds> <keyer> <L|R|K|T> <1|0> <wpm> [audio frame]
+
+    L and R are the paddles as wired, K the keyed output and T the
+    sidetone taking a key event, the times from the first record kept.
+
+    or with -r, keyer -k's paddle edges as a trace for replay, the times
+    from its first edge, and the speed as a comment:
+
+        journal_read -r iambic.jrn > trace && replay -s 25 trace
+
+    /dev/shm/iambic-keyer-journal is the ring itself, which can be read
+    whilst the keyer is still writing it, and the file is as of the last
+    copy.
+
+    journal_read [-r] [-k keyer] journal
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+static const char sources[] = "LRKT";
+
+int main(int argc, char **argv) {
+    int i, fd, trace = 0, keyer = 0, first = 1, wpm = 0;
+    unsigned long long n, head, start, skipped = 0;
+    int64_t t = 0;
+    uint32_t last = 0;
+    journal_header_t *h;
+    journal_record_t *records, r;
+    struct stat st;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+        switch (argv[i][1]) {
+        case 'r':
+            trace = 1;
+            break;
+        case 'k':
+            if (++i < argc)
+                keyer = atoi(argv[i]);
+            break;
+        default:
+            fprintf(stderr, "journal_read [-r replay trace] [-k keyer (default is 0)] journal\n");
+            exit(1);
+        }
+    if (i != argc - 1) {
+        fprintf(stderr, "journal_read [-r replay trace] [-k keyer (default is 0)] journal\n");
+        exit(1);
+    }
+
+    fd = open(argv[i], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[i]);
+        exit(1);
+    }
+    h = (st.st_size >= (off_t)sizeof(*h)) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (h == MAP_FAILED || h->magic != JOURNAL_MAGIC) {
+        fprintf(stderr, "%s: not a journal\n", argv[i]);
+        exit(1);
+    }
+    if (h->version != JOURNAL_VERSION || h->record_size != sizeof(journal_record_t) ||
+        st.st_size < (off_t)(sizeof(*h) + (size_t)h->records * sizeof(journal_record_t))) {
+        fprintf(stderr, "%s: journal version %u, this reads %d\n", argv[i], h->version, JOURNAL_VERSION);
+        exit(1);
+    }
+    records = (journal_record_t *)(h + 1);
+
+    head = atomic_load_explicit(&h->head, memory_order_acquire);
+    start = head > h->records ? head - h->records : 0;
+    for (n = start; n < head; n++) {
+        journal_record_t *p = &records[n & (h->records - 1)];
+
+        /* overwritten, or still being written, since head was read */
+        if (atomic_load_explicit(&p->seq, memory_order_acquire) != (uint32_t)n) {
+            skipped++;
+            continue;
+        }
+        memcpy(&r, p, sizeof(r));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&p->seq, memory_order_relaxed) != (uint32_t)n) {
+            skipped++;
+            continue;
+        }
+
+        if (trace && (r.id != keyer || r.source > JOURNAL_RIGHT))
+            continue;
+        /*
+        ** the ticks wrap every 71 minutes, their differences don't.  the
+        ** threads claim records in the order they get to them, so a tick
+        ** can be a little older than the one before.
+        */
+        if (!first)
+            t += (int32_t)(r.tick - last);
+        last = r.tick;
+
+        if (trace) {
+            if (first || r.wpm != wpm)
+                printf("# %d wpm\n", r.wpm);
+            wpm = r.wpm;
+            printf("%lld %c %d\n", (long long)t, sources[r.source], r.state);
+        }
+        else if (r.source == JOURNAL_TONE)
+            printf("%lld %d %c %d %d %u\n", (long long)t, r.id, sources[r.source], r.state, r.wpm, r.frame);
+        else if (r.source <= JOURNAL_TONE)
+            printf("%lld %d %c %d %d\n", (long long)t, r.id, sources[r.source], r.state, r.wpm);
+        first = 0;
+    }
+
+    if (start || skipped)
+        fprintf(stderr, "%llu records older than the ring lost, %llu being written skipped\n", start, skipped);
+    return 0;
+}
@@ -11,126 +11,967 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <jack/jack.h>
+#include <jack/midiport.h>
+#define KEYED_TONE_STORAGE
 #include "keyed_tone.h"
+#include "keyer_stats.h"
+#include "journal.h"
 
-int keyed_tone_mute = 0;
+/*Our output ports, the tone is rendered into the first and copied to the rest*/
+#define KEYED_TONE_MAX_CHANNELS 8
 
-/*Our output port*/
 jack_port_t *output_port;
+static jack_port_t *output_ports[KEYED_TONE_MAX_CHANNELS];
+static int channels = 1;
+static const char *connect_regex;	/* playback ports to connect to, NULL for the physical ones */
+
+/*and the key as MIDI notes, if asked for*/
+jack_port_t *midi_port;
+static int midi_note = -1;
 
 typedef jack_default_audio_sample_t sample_t;
 
 /*The current sample rate*/
 jack_nframes_t sr;
 
-keyed_tone_t tone;
 struct {
     int	freq;	/* frequency of keyed tone */
     int	gain;	/* gain in decibels of keyed tone */
     int	rise;	/* rise time in milliseconds */
     int	fall;	/* fall time in milliseconds */
     int	srate;	/* samples per second */
+    int	window;	/* ramp window_type_t */
 } tone_opts = {
-    700, -6, 5, 5, 48000
+    700, -6, 5, 5, 48000, WINDOW_BLACKMAN_HARRIS
 };
 
-static jack_client_t *client;
+/*
+** swapped for a new one when the server restarts.  the old one isn't
+** closed then, a keyer thread may be stamping a key event on it right
+** then, but retired, and closed on the restart after, or at the end,
+** by when nothing can still have it.
+*/
+static _Atomic(jack_client_t *) client;
+static jack_client_t *retired;
+static sem_t jack_gone;		/* posted by jack_shutdown() */
+static pthread_t reconnect_thread_id;
+static volatile int jack_closing;
+static int reconnecting;		/* the thread is running */
 
-int process (jack_nframes_t nframes, void *arg) {
-    /*grab our output buffer*/
-    sample_t *out = (sample_t *) jack_port_get_buffer (output_port, nframes);
-    jack_nframes_t i;
+/*
+** key events, stamped with the JACK frame time at which the keyer
+** changed state.  single producer (the keyer thread), single consumer
+** (process()), so a pair of free running indices is all the locking
+** needed.  the size must be a power of two, 64 is several times the
+** transitions 60 wpm makes in the longest period we take.  every
+** transition keeps its order and frame, and a full queue is counted in
+** the stats rather than silently dropped.
+*/
+#define KEY_EVENT_QUEUE_SIZE 64
+
+typedef struct {
+    jack_nframes_t frame;	/* jack_frame_time() of the transition */
+    int on;			/* key down or key up */
+    jack_nframes_t frames;	/* a key down's length when the keyer knew it, or 0 */
+} key_event_t;
+
+/*
+** pre-rendered elements.  at a given speed, pitch and gain every dot is
+** the same waveform, and so is every dash, so with the cache on a thread
+** of its own renders both, rise to end of fall, and process() plays a
+** timed key down of the same length by copying it.  there are two sets
+** per tone, process() plays from the live one while the other is
+** rendered, and they swap when it's done.  anything the live set
+** doesn't match, a text mark a frame off or a new pitch not yet
+** rendered, is synthesised as before.
+*/
+#define ELEMENT_MAX_SAMPLES (32*1024)	/* a dash down to 8 wpm at 48 kHz */
+
+typedef struct {
+    int freq, gain;
+    unsigned srate;		/* what it was rendered for */
+    jack_nframes_t frames[2];	/* the dot and dash key down lengths */
+    int len[2];			/* their samples, rise to end of fall, 0 if not rendered */
+    float *buf[2];
+} element_set_t;
+
+/*
+** one sidetone per keyer, each with its own key events, pitch and
+** gain.  they share the envelope and the sample rate.
+*/
+#define KEYED_TONE_MAX_TONES 4
+
+typedef struct {
+    keyed_tone_t tone;
+    int freq, gain;		/* as applied */
+    unsigned srate;		/* as applied */
+    atomic_int freq_req, gain_req;	/* as asked for, applied by process() while the tone is off */
+    key_event_t events[KEY_EVENT_QUEUE_SIZE];
+    atomic_uint head, tail;
+
+    element_set_t sets[2];
+    atomic_int live;		/* the set process() starts elements from */
+    atomic_int playing;		/* the set process() is copying from, or -1 */
+    atomic_uint element_ticks[2], element_rate;	/* dot and dash, as the keyer sends them */
+    const float *play;		/* process() only, the element being copied or NULL */
+    int play_len, play_pos;
+    jack_nframes_t play_frames;
+} sidetone_t;
+
+static sidetone_t sidetones[KEYED_TONE_MAX_TONES];
+static int ntones = 1;
+
+/* where a tone is mixed when there are several, big enough for any JACK period */
+#define KEYED_TONE_MAX_FRAMES 8192
+static sample_t mix[KEYED_TONE_MAX_FRAMES];
+static int16_t mix16[KEYED_TONE_MAX_FRAMES];
+
+/* optional keyer engine run at the start of every cycle */
+static void (*keyer_clock)(unsigned nframes, unsigned sample_rate);
+
+/* first frame of the period being rendered by process() */
+static jack_nframes_t cycle_base;
+
+/* the backend's frame time, jack_frame_time() or the ALSA equivalent */
+static jack_nframes_t (*frame_clock)(void);
+
+/* sample rate asked for, applied to each tone by process() while it is off */
+static atomic_uint tone_srate_req;
+
+static int cache_on;
+static sem_t cache_wake;
+
+/* idle fast path, after idle_ms of every tone silent */
+static int idle_ms;
+static jack_nframes_t quiet;	/* frames every tone has been silent for */
+static pthread_t cache_thread_id;
+
+/* period to ask the server for, 0 to leave it alone */
+static jack_nframes_t period_req;
+
+static void key_event_push(sidetone_t *t, int on, jack_nframes_t frame, jack_nframes_t frames) {
+    unsigned head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+
+    if (head - tail >= KEY_EVENT_QUEUE_SIZE) {
+        /* process() has stalled, nothing sensible to do but count it */
+        atomic_fetch_add_explicit(&keyer_stats->key_overflows, 1, memory_order_relaxed);
+        return;
+    }
+
+    t->events[head & (KEY_EVENT_QUEUE_SIZE-1)].frame = frame;
+    t->events[head & (KEY_EVENT_QUEUE_SIZE-1)].on = on;
+    t->events[head & (KEY_EVENT_QUEUE_SIZE-1)].frames = frames;
+    atomic_store_explicit(&t->head, head+1, memory_order_release);
+}
+
+void keyed_tone_key(int id, int on) {
+    key_event_push(&sidetones[id], on, frame_clock(), 0);
+}
+
+/* only valid from inside the keyer_clock callback */
+void keyed_tone_key_at(int id, int on, unsigned offset) {
+    key_event_push(&sidetones[id], on, cycle_base + offset, 0);
+}
+
+static jack_nframes_t ticks_to_frames(unsigned ticks, unsigned tick_rate, unsigned rate) {
+    jack_nframes_t frames = ((uint64_t)ticks * rate + tick_rate/2) / tick_rate;
+    return frames ? frames : 1;
+}
+
+/*
+** a key down the keyer knows the length of, and the key up that ends it,
+** which process() doesn't need for the tone: it falls on its own, at
+** exactly the length after it rose, however late the key up is stamped.
+*/
+void keyed_tone_key_for(int id, int on, unsigned ticks, unsigned tick_rate) {
+    key_event_push(&sidetones[id], on, frame_clock(), ticks_to_frames(ticks, tick_rate, sr));
+}
+
+void keyed_tone_key_for_at(int id, int on, unsigned ticks, unsigned tick_rate, unsigned offset) {
+    key_event_push(&sidetones[id], on, cycle_base + offset, ticks_to_frames(ticks, tick_rate, sr));
+}
+
+/* safe from any thread, takes effect at the next silence */
+void keyed_tone_set(int id, long volume, double freq) {
+    atomic_store_explicit(&sidetones[id].gain_req, volume, memory_order_relaxed);
+    atomic_store_explicit(&sidetones[id].freq_req, freq, memory_order_relaxed);
+    if (cache_on)
+        sem_post(&cache_wake);
+}
+
+/* safe from any thread, sem_post() is all it costs */
+void keyed_tone_set_elements(int id, unsigned dot_ticks, unsigned dash_ticks, unsigned tick_rate) {
+    atomic_store_explicit(&sidetones[id].element_ticks[0], dot_ticks, memory_order_relaxed);
+    atomic_store_explicit(&sidetones[id].element_ticks[1], dash_ticks, memory_order_relaxed);
+    atomic_store_explicit(&sidetones[id].element_rate, tick_rate, memory_order_relaxed);
+    if (cache_on)
+        sem_post(&cache_wake);
+}
+
+/* before keyed_tone_start() */
+void keyed_tone_set_cache(int on) {
+    cache_on = on;
+}
+
+/* before keyed_tone_start() */
+void keyed_tone_set_idle(int ms) {
+    idle_ms = ms;
+}
+
+/*
+** render the set process() isn't starting from, for the pitch, gain and
+** rate it will be playing at, then make it the live one.  a set process()
+** may still be copying from is waited for.  this thread never prepares
+** ramp tables, it only looks them up, so if they're not there yet it
+** waits for the next wake.
+*/
+static void element_cache_refresh(sidetone_t *t) {
+    int freq = atomic_load_explicit(&t->freq_req, memory_order_relaxed);
+    int gain = atomic_load_explicit(&t->gain_req, memory_order_relaxed);
+    unsigned rate = atomic_load_explicit(&tone_srate_req, memory_order_acquire);
+    unsigned tick_rate = atomic_load_explicit(&t->element_rate, memory_order_relaxed);
+    int live = atomic_load(&t->live), next = !live, k;
+    element_set_t *s = &t->sets[live];
+    jack_nframes_t frames[2];
+    keyed_tone_t tone;
+
+    if (tick_rate == 0 || rate == 0)
+        return;
+    for (k = 0; k < 2; k++)
+        frames[k] = ticks_to_frames(atomic_load_explicit(&t->element_ticks[k], memory_order_relaxed),
+                                    tick_rate, rate);
+    if (s->freq == freq && s->gain == gain && s->srate == rate &&
+        s->frames[0] == frames[0] && s->frames[1] == frames[1])
+        return;
+
+    memset(&tone, 0, sizeof(tone));
+    if (keyed_tone_update(&tone, gain, freq, tone_opts.window, tone_opts.rise, tone_opts.fall, rate) < 0)
+        return;
+
+    while (atomic_load(&t->playing) == next)
+        usleep(1000);
+    s = &t->sets[next];
+    for (k = 0; k < 2; k++) {
+        s->frames[k] = frames[k];
+        s->len[k] = keyed_tone_render_element(&tone, s->buf[k], ELEMENT_MAX_SAMPLES, frames[k]);
+        if (s->len[k] < 0)
+            s->len[k] = 0;
+    }
+    s->freq = freq;
+    s->gain = gain;
+    s->srate = rate;
+    atomic_store(&t->live, next);
+}
+
+static void* cache_thread(void *arg) {
+    int t;
+
+    for (;;) {
+        while (sem_wait(&cache_wake) != 0)
+            ;
+        for (t = 0; t < ntones; t++)
+            element_cache_refresh(&sidetones[t]);
+    }
+    return NULL;
+}
+
+static int element_cache_start() {
+    float *arena = malloc((size_t)ntones * 4 * ELEMENT_MAX_SAMPLES * sizeof(float));
+    int t, k, err;
+
+    if (arena == NULL) {
+        fprintf(stderr, "no memory for the element cache, synthesising\n");
+        cache_on = 0;
+        return -1;
+    }
+    for (t = 0; t < ntones; t++)
+        for (k = 0; k < 4; k++)
+            sidetones[t].sets[k/2].buf[k%2] = arena + (t*4 + k) * ELEMENT_MAX_SAMPLES;
+    for (t = 0; t < ntones; t++)
+        atomic_init(&sidetones[t].playing, -1);
+
+    sem_init(&cache_wake, 0, 1);
+    err = pthread_create(&cache_thread_id, NULL, cache_thread, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_create for the element cache failed, synthesising\n");
+        cache_on = 0;
+        return -1;
+    }
+    pthread_detach(cache_thread_id);
+    return 0;
+}
+
+/*
+** process() only.  start copying the live set's element of this length,
+** returns 0 if there isn't one for the tone as it is.  playing is stored
+** before live is read again, and the cache thread stores live before it
+** reads playing, so one of them always sees the other.
+*/
+static int element_start(sidetone_t *t, jack_nframes_t frames) {
+    int live, k;
+    element_set_t *s;
+
+    t->play = NULL;
+    if (!cache_on || frames == 0) {
+        atomic_store_explicit(&t->playing, -1, memory_order_relaxed);
+        return 0;
+    }
+
+    live = atomic_load(&t->live);
+    atomic_store(&t->playing, live);
+    if (atomic_load(&t->live) == live) {
+        s = &t->sets[live];
+        if (s->freq == t->freq && s->gain == t->gain && s->srate == t->srate)
+            for (k = 0; k < 2; k++)
+                if (s->len[k] && s->frames[k] == frames) {
+                    t->play = s->buf[k];
+                    t->play_len = s->len[k];
+                    t->play_pos = 0;
+                    t->play_frames = frames;
+                    t->tone.state = KEYED_TONE_OFF;
+                    return 1;
+                }
+    }
+    atomic_store(&t->playing, -1);
+    return 0;
+}
+
+static void element_stop(sidetone_t *t) {
+    t->play = NULL;
+    atomic_store_explicit(&t->playing, -1, memory_order_release);
+}
+
+/*
+** a copied element cut short by a key up: carry on synthesising from
+** the same phase, and fall from there.  past its key down it is already
+** falling, so there is nothing to do.
+*/
+static void element_cut(sidetone_t *t) {
+    double w = 2 * M_PI * t->freq / t->srate;
+
+    if ((jack_nframes_t)t->play_pos >= t->play_frames)
+        return;
+    oscillator_set_phase(&t->tone.tone, fmod(w * t->play_pos, 2 * M_PI));
+    keyed_tone_off(&t->tone);
+    element_stop(t);
+}
+
+/* the next n samples of a tone, copied while there is an element to copy */
+static void sidetone_block(sidetone_t *t, sample_t *out, int n) {
+    int m;
+
+    if (t->play) {
+        m = t->play_len - t->play_pos;
+        if (m > n) m = n;
+        memcpy(out, t->play + t->play_pos, m * sizeof(sample_t));
+        t->play_pos += m;
+        if (t->play_pos == t->play_len)
+            element_stop(t);
+        out += m;
+        n -= m;
+    }
+    keyed_tone_process_block(&t->tone, out, n);
+}
+
+/*
+** no allocation, a new sample rate only swaps in the ramp tables srate()
+** prepared for it, so the oscillator step and the envelope times change
+** together at a silence.
+*/
+static void tone_params_apply(sidetone_t *t, unsigned rate) {
+    int freq = atomic_load_explicit(&t->freq_req, memory_order_relaxed);
+    int gain = atomic_load_explicit(&t->gain_req, memory_order_relaxed);
+
+    if (rate != t->srate) {
+        if (keyed_tone_update(&t->tone, gain, freq, tone_opts.window, tone_opts.rise, tone_opts.fall, rate) < 0)
+            return;		/* tables not there yet, try again next cycle */
+        t->freq = freq;
+        t->gain = gain;
+        t->srate = rate;
+    }
+    else if (freq != t->freq || gain != t->gain) {
+        t->freq = freq;
+        t->gain = gain;
+        keyed_tone_set_gain(&t->tone, gain);
+        oscillator_update(&t->tone.tone, freq, rate);
+    }
+}
+
+void keyed_tone_set_clock(void (*clock)(unsigned nframes, unsigned sample_rate)) {
+    keyer_clock = clock;
+}
+
+/* before keyed_tone_start() */
+void keyed_tone_set_period(unsigned nframes) {
+    period_req = nframes;
+}
+
+/*
+** before keyed_tone_start(), channels output ports and the ports to
+** connect them to.  every port matching regex is connected, taking
+** the outputs in turn, so one channel fans out to all of them.  with
+** no regex the outputs go one each to the first physical ports.
+*/
+void keyed_tone_set_ports(int nchannels, const char *regex) {
+    if (nchannels < 1) nchannels = 1;
+    if (nchannels > KEYED_TONE_MAX_CHANNELS) nchannels = KEYED_TONE_MAX_CHANNELS;
+    channels = nchannels;
+    connect_regex = regex;
+}
+
+/* before keyed_tone_start(), sidetones for n keyers */
+void keyed_tone_set_tones(int n) {
+    if (n < 1) n = 1;
+    if (n > KEYED_TONE_MAX_TONES) n = KEYED_TONE_MAX_TONES;
+    ntones = n;
+}
+
+/*
+** before keyed_tone_start(), a note from 0 to 127 on channel 1 for the
+** first keyer, the next note up for the next, or -1 for no MIDI port
+*/
+void keyed_tone_set_midi(int note) {
+    midi_note = note;
+}
+
+/*
+** the cycle's key transitions, every tone's, at the offsets the tones
+** start or stop.  the tones are rendered one after another, and JACK
+** takes MIDI events in time order only, so they are collected here and
+** written sorted once every tone has been.
+*/
+typedef struct {
+    jack_nframes_t offset;
+    int id, on;
+} midi_key_t;
+
+static midi_key_t midi_keys[KEYED_TONE_MAX_TONES * KEY_EVENT_QUEUE_SIZE];
+static int nmidi_keys;
+
+static void midi_key(jack_nframes_t offset, int id, int on) {
+    if (nmidi_keys < (int)(sizeof(midi_keys) / sizeof(midi_keys[0]))) {
+        midi_keys[nmidi_keys].offset = offset;
+        midi_keys[nmidi_keys].id = id;
+        midi_keys[nmidi_keys++].on = on;
+    }
+    else
+        atomic_fetch_add_explicit(&keyer_stats->midi_dropped, 1, memory_order_relaxed);
+}
+
+/* each tone's are in order already, so an insertion sort is nearly free */
+static void midi_flush(void *buf) {
+    jack_midi_data_t msg[3];
+    int i, j;
+
+    for (i = 1; i < nmidi_keys; i++)
+        for (j = i; j > 0 && midi_keys[j-1].offset > midi_keys[j].offset; j--) {
+            midi_key_t k = midi_keys[j];
+            midi_keys[j] = midi_keys[j-1];
+            midi_keys[j-1] = k;
+        }
+    for (i = 0; i < nmidi_keys; i++) {
+        msg[0] = midi_keys[i].on ? 0x90 : 0x80;
+        msg[1] = (midi_note + midi_keys[i].id) & 0x7f;
+        msg[2] = midi_keys[i].on ? 127 : 0;
+        if (jack_midi_event_write(buf, midi_keys[i].offset, msg, 3))
+            atomic_fetch_add_explicit(&keyer_stats->midi_dropped, 1, memory_order_relaxed);
+    }
+    nmidi_keys = 0;
+}
+
+/*
+** frames from a key down being stamped to its rise leaving process(),
+** which renders a period behind the keyer on purpose, so that period
+** counts.  the device's own latency, report_latency()'s, doesn't.
+*/
+static void key_event_latency(jack_nframes_t frames) {
+    unsigned us = (uint64_t)frames * 1000000 / sr;
+    int paddle_us = atomic_exchange_explicit(&keyer_stats->pending_us, -1, memory_order_relaxed);
 
-    /*For each required sample*/
-    for(i=0; i<nframes; i++) {
-        if(keyed_tone_mute == 1) {
-            keyed_tone_mute = 0;
-            keyed_tone_off(&tone);
+    latency_record(&keyer_stats->gpio_to_tone, us);
+    if (paddle_us >= 0)
+        latency_record(&keyer_stats->paddle_to_tone, paddle_us + us);
+}
+
+/*
+** one tone's nframes, applying its key events at their frames, as
+** floats into out or, if out16 is set, as 16 bit samples into that
+** instead, which never plays from the element cache.
+*/
+static void sidetone_render(sidetone_t *t, int id, sample_t *out, int16_t *out16, void *midi, jack_nframes_t base, jack_nframes_t nframes) {
+    unsigned tail, head;
+    jack_nframes_t i = 0, until;
+
+    tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&t->head, memory_order_acquire);
+
+    while (i < nframes) {
+        until = nframes;
+
+        if (tail != head) {
+            key_event_t *ev = &t->events[tail & (KEY_EVENT_QUEUE_SIZE-1)];
+            int32_t offset = (int32_t)(ev->frame - base);
+
+            /* due now, late, or stamped on a server that has gone */
+            if (offset <= (int32_t)i || offset > 2 * KEYED_TONE_MAX_FRAMES) {
+                journal_write(JOURNAL_TONE, id, ev->on, 0, journal_now() + (uint64_t)i * 1000000 / sr, base + i);
+                if (ev->on) {
+                    key_event_latency(base + nframes + i - ev->frame);
+                    if (out16 || !element_start(t, ev->frames))
+                        keyed_tone_on_for(&t->tone, ev->frames);
+                }
+                else if (ev->frames == 0) {
+                    if (t->play)
+                        element_cut(t);
+                    else
+                        keyed_tone_off(&t->tone);
+                }
+                if (midi)
+                    midi_key(i, id, ev->on);
+                tail++;
+                continue;
+            }
+            if (offset < (int32_t)nframes)
+                until = offset;		/* otherwise it belongs to the next cycle */
         }
-        else if(keyed_tone_mute == 2) {
-            keyed_tone_mute = 0;
-            keyed_tone_on(&tone);
+
+        if (out16)
+            keyed_tone_process_block_s16(&t->tone, out16+i, until-i);
+        else
+            sidetone_block(t, out+i, until-i);
+        i = until;
+    }
+
+    atomic_store_explicit(&t->tail, tail, memory_order_release);
+}
+
+/* nothing sounding, being copied, or waiting to be started */
+static int tones_silent() {
+    int t;
+
+    for (t = 0; t < ntones; t++)
+        if (sidetones[t].tone.state != KEYED_TONE_OFF || sidetones[t].play != NULL ||
+            atomic_load_explicit(&sidetones[t].head, memory_order_acquire) !=
+            atomic_load_explicit(&sidetones[t].tail, memory_order_relaxed))
+            return 0;
+    return 1;
+}
+
+/*
+** the start of every cycle, for either renderer: the keyer clock, the
+** stats, the idle check and the parameter changes.  returns 1 if the
+** cycle is idle and only wants zeroing.
+*/
+static int cycle_start(void *midi, jack_nframes_t base, jack_nframes_t nframes) {
+    unsigned rate = atomic_load_explicit(&tone_srate_req, memory_order_acquire), settled = 1;
+    int t;
+
+    cycle_base = base;
+    if (keyer_clock)
+        keyer_clock(nframes, sr);
+
+    atomic_fetch_add_explicit(&keyer_stats->audio_frames, nframes, memory_order_relaxed);
+    atomic_store_explicit(&keyer_stats->audio_rate, sr, memory_order_relaxed);
+    if (midi)
+        jack_midi_clear_buffer(midi);
+    if (idle_ms && tones_silent()) {
+        if (quiet < (uint64_t)idle_ms * sr / 1000)
+            quiet += nframes;
+        else {
+            atomic_fetch_add_explicit(&keyer_stats->idle_frames, nframes, memory_order_relaxed);
+            return 1;
         }
+    }
+    else
+        quiet = 0;
+
+    for (t = 0; t < ntones; t++) {
+        if (sidetones[t].tone.state == KEYED_TONE_OFF && sidetones[t].play == NULL)
+            tone_params_apply(&sidetones[t], rate);
+        if (sidetones[t].srate != rate)
+            settled = 0;
+    }
+    if (settled)
+        sr = tone_opts.srate = rate;
+    return 0;
+}
+
+/*
+** render nframes starting at frame base + nframes into nout buffers.
+** events stamped during the previous cycle land in this one at the
+** same offset, so the sidetone runs a constant one period behind the
+** keyer instead of jittering by up to a period on every edge.
+**
+** a single tone is rendered once into out[0] and copied to the rest.
+** several are each rendered once and mixed into out[id % nout], so
+** with as many outputs as keyers every keyer gets its own.  shared by
+** the backends, midi is the JACK MIDI buffer or NULL.
+**
+** idle, once every tone has been silent for idle_ms, a cycle is only a
+** memset, with no parameter changes or rendering.  a key event waiting
+** ends it in the cycle it arrives, so the tone starts when it would have.
+*/
+int keyed_tone_render(sample_t **out, int nout, void *midi, jack_nframes_t base, jack_nframes_t nframes) {
+    jack_nframes_t i;
+    int t, c;
+
+    if (cycle_start(midi, base, nframes)) {
+        for (c = 0; c < nout; c++)
+            memset(out[c], 0, nframes * sizeof(sample_t));
+        return 1;
+    }
 
-        out[i] = keyed_tone_process(&tone);
+    if (ntones == 1) {
+        sidetone_render(&sidetones[0], 0, out[0], NULL, midi, base, nframes);
+        for (c = 1; c < nout; c++)
+            memcpy(out[c], out[0], nframes * sizeof(sample_t));
+        if (midi)
+            midi_flush(midi);
+        return 0;
     }
 
+    for (c = 0; c < nout; c++)
+        memset(out[c], 0, nframes * sizeof(sample_t));
+    for (t = 0; t < ntones; t++) {
+        sidetone_render(&sidetones[t], t, mix, NULL, midi, base, nframes);
+        for (i = 0; i < nframes; i++)
+            out[t % nout][i] += mix[i];
+    }
+    if (midi)
+        midi_flush(midi);
+    return 0;
+}
+
+/*
+** keyed_tone_render() as 16 bit samples, interleaved over nout
+** channels, for a DAC that takes them as they are.  the tones are
+** assigned to channels the same way and mixed with saturation.  with
+** OSCILLATOR_Q no float is touched once the parameters are set.
+*/
+int keyed_tone_render_s16(int16_t *out, int nout, jack_nframes_t base, jack_nframes_t nframes) {
+    jack_nframes_t i;
+    int t, c, v;
+
+    if (cycle_start(NULL, base, nframes)) {
+        memset(out, 0, nframes * nout * sizeof(int16_t));
+        return 1;
+    }
+
+    if (ntones == 1) {
+        sidetone_render(&sidetones[0], 0, NULL, mix16, NULL, base, nframes);
+        for (i = 0; i < nframes; i++)
+            for (c = 0; c < nout; c++)
+                out[i * nout + c] = mix16[i];
+        return 0;
+    }
+
+    memset(out, 0, nframes * nout * sizeof(int16_t));
+    for (t = 0; t < ntones; t++) {
+        sidetone_render(&sidetones[t], t, NULL, mix16, NULL, base, nframes);
+        c = t % nout;
+        for (i = 0; i < nframes; i++) {
+            v = out[i * nout + c] + mix16[i];
+            out[i * nout + c] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+        }
+    }
     return 0;
 }
 
+static uint64_t cycle_ns() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+int process (jack_nframes_t nframes, void *arg) {
+    /*grab our output buffers*/
+    sample_t *out[KEYED_TONE_MAX_CHANNELS];
+    void *midi = midi_port ? jack_port_get_buffer (midi_port, nframes) : NULL;
+    uint64_t start = cycle_ns();
+    unsigned load;
+    int c;
+
+    for (c = 0; c < channels; c++)
+        out[c] = (sample_t *) jack_port_get_buffer (output_ports[c], nframes);
+    keyed_tone_render(out, channels, midi, jack_last_frame_time(arg) - nframes, nframes);
+
+    /* the whole callback, and the server's view of the graph */
+    latency_record(&keyer_stats->render_ns, cycle_ns() - start);
+    load = jack_cpu_load(arg) * 100;
+    atomic_store_explicit(&keyer_stats->dsp_load, load, memory_order_relaxed);
+    stats_max(&keyer_stats->dsp_load_max, load);
+    return 0;
+}
+
+/* from JACK's notification thread, like srate() */
+int xrun (void *arg) {
+    atomic_fetch_add_explicit(&keyer_stats->xruns, 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+** called from JACK's notification thread, not process(), so it can
+** build the ramp tables for the new rate before handing it over.
+*/
 int srate (jack_nframes_t nframes, void *arg) {
-    printf ("the sample rate is now %lu/sec\n", nframes);
-    sr=nframes;
+    printf ("the sample rate is now %lu/sec\n", (unsigned long)nframes);
+    if (ramp_prepare(tone_opts.window, ramp_length(tone_opts.rise, nframes)) == NULL ||
+        ramp_prepare(tone_opts.window, ramp_length(tone_opts.fall, nframes)) == NULL)
+        fprintf(stderr, "no room for the ramps at %lu/sec, keeping the old ones\n", (unsigned long)nframes);
+    atomic_store_explicit(&tone_srate_req, nframes, memory_order_release);
+    if (cache_on)
+        sem_post(&cache_wake);
+    return 0;
+}
+
+/* what a key down takes to reach the speakers, process() adds a period */
+static void report_latency() {
+    jack_latency_range_t range;
+    jack_nframes_t period = jack_get_buffer_size(client), rate = jack_get_sample_rate(client);
+
+    jack_port_get_latency_range(output_port, JackPlaybackLatency, &range);
+    printf("latency: period %u frames, playback %u-%u frames, key to sound %.2f-%.2f ms\n",
+           period, range.min, range.max,
+           (period + range.min) * 1000.0 / rate, (period + range.max) * 1000.0 / rate);
+}
+
+/* nothing in process() depends on the period, so there is only the latency to report */
+int bufsize (jack_nframes_t nframes, void *arg) {
+    printf ("the period is now %u frames\n", nframes);
+    atomic_store_explicit(&keyer_stats->audio_period, nframes, memory_order_relaxed);
     return 0;
 }
 
+void latency (jack_latency_callback_mode_t mode, void *arg) {
+    if (mode == JackPlaybackLatency)
+        report_latency();
+}
+
 void error (const char *desc) {
     fprintf (stderr, "JACK error: %s\n", desc);
 }
 
+static void quiet_error (const char *desc) {
+}
+
+/*
+** JACK may not be called from here, so the reconnect thread does the rest
+** and the keyer carries on.  with -t 1 it stops until the server is back.
+*/
 void jack_shutdown (void *arg) {
-    exit (1);
+    sem_post(&jack_gone);
 }
 
 void keyed_tone_close() {
+    jack_closing = 1;
+    if (reconnecting) {
+        sem_post(&jack_gone);
+        pthread_join(reconnect_thread_id, NULL);
+    }
+    if (retired)
+        jack_client_close (retired);
     jack_client_close (client);
 }
 
-int keyed_tone_start(long volume, double freq, int envelope) {
-    const char **ports;
-    const char *clientname = "iambic-keyer";
+static jack_nframes_t jack_clock() {
+    return jack_frame_time(client);
+}
+
+/*
+** set the tone up for a backend running at sample_rate, which stamps
+** key events with clock() and calls keyed_tone_render() once a period.
+*/
+void keyed_tone_attach(long volume, double freq, int envelope, int window,
+                       unsigned sample_rate, jack_nframes_t (*clock)(void)) {
+    int t;
 
     tone_opts.freq = freq;
     tone_opts.gain = volume;
     tone_opts.rise = tone_opts.fall = envelope;
+    tone_opts.window = window;
+    frame_clock = clock;
 
-    jack_set_error_function (error);
+    tone_opts.srate = sr = sample_rate;
+    atomic_store(&tone_srate_req, sr);
+    for (t = 0; t < ntones; t++) {
+        sidetone_t *st = &sidetones[t];
+        keyed_tone_init(&st->tone, volume, freq, tone_opts.window, tone_opts.rise, tone_opts.fall, sr);
+        st->freq = freq;
+        st->gain = volume;
+        st->srate = sr;
+        keyed_tone_set(t, volume, freq);
+    }
+    if (sidetones[0].tone.rise.target == 1 && tone_opts.rise > 0)
+        fprintf(stderr, "no room for a %d ms ramp at %d/sec, keying hard\n", tone_opts.rise, tone_opts.srate);
+    if (cache_on)
+        element_cache_start();
+}
+
+/*
+** a client with its callbacks and ports, not yet active, or NULL with
+** nothing left open if the server isn't there or won't have us.
+*/
+static jack_client_t *jack_open (jack_options_t options) {
+    const char *clientname = "iambic-keyer";
+    jack_client_t *c;
+    char name[32];
+    int k;
 
     /* Connect to the JACK daemon */
-    if ((client = jack_client_open (clientname, JackNullOption, NULL)) == 0) {
-        fprintf(stderr, "jack server not running?\n");
-        return 1;
-    }
+    if ((c = jack_client_open (clientname, options, NULL)) == 0)
+        return NULL;
 
     /* tell the JACK server to call `process()' whenever
        there is work to be done.  */
-    jack_set_process_callback (client, process, 0);
+    jack_set_process_callback (c, process, c);
 
     /* tell the JACK server to call `srate()' whenever
        the sample rate of the system changes.  */
-    jack_set_sample_rate_callback (client, srate, 0);
+    jack_set_sample_rate_callback (c, srate, 0);
+
+    /* and `bufsize()' and `latency()' when the period or
+       the latency to the playback ports change, and `xrun()'
+       when a cycle was missed.  */
+    jack_set_buffer_size_callback (c, bufsize, 0);
+    jack_set_latency_callback (c, latency, 0);
+    jack_set_xrun_callback (c, xrun, 0);
+
+    if (period_req && jack_set_buffer_size (c, period_req))
+        fprintf(stderr, "cannot set the period to %u frames\n", period_req);
+    atomic_store(&keyer_stats->audio_period, jack_get_buffer_size (c));
 
     /* tell the JACK server to call `jack_shutdown()' if
        it ever shuts down, either entirely, or if it
        just decides to stop calling us.  */
-    jack_on_shutdown (client, jack_shutdown, 0);
+    jack_on_shutdown (c, jack_shutdown, 0);
+
+    for (k = 0; k < channels; k++) {
+        if (k == 0)
+            strcpy(name, "output");
+        else
+            snprintf(name, sizeof(name), "output_%d", k+1);
+        if ((output_ports[k] = jack_port_register (c, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0)) == NULL) {
+            fprintf(stderr, "cannot register port %s\n", name);
+            jack_client_close (c);
+            return NULL;
+        }
+    }
+    output_port = output_ports[0];
+    if (midi_note >= 0) {
+        midi_port = jack_port_register (c, "key", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+        if (midi_port == NULL)
+            fprintf(stderr, "cannot register the MIDI key port\n");
+    }
+    return c;
+}
+
+/* returns 1 if there was nothing to connect to */
+static int jack_connect_ports () {
+    const char **ports;
+    int c;
+
+    if (connect_regex)
+        ports = jack_get_ports (client, connect_regex, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput);
+    else
+        ports = jack_get_ports (client, NULL, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical|JackPortIsInput);
+    if (ports == NULL) {
+        fprintf(stderr, "Cannot find any playback ports matching %s\n", connect_regex ? connect_regex : "physical");
+        return 1;
+    }
+
+    for (c = 0; ports[c] != NULL && (connect_regex || c < channels); c++)
+        if (jack_connect (client, jack_port_name (output_ports[c % channels]), ports[c])) {
+            fprintf (stderr, "cannot connect %s to %s\n", jack_port_name (output_ports[c % channels]), ports[c]);
+        }
+
+    jack_free (ports);
+    return 0;
+}
+
+/*
+** waits for jack_shutdown() and opens a client on the next server to
+** come up, once a second until one does.  the tones carry on from
+** silence, with the events stamped on the old server's clock dropped,
+** and at the new server's rate if it changed.
+*/
+static void* reconnect_thread(void *arg) {
+    jack_client_t *c;
+    int t;
+
+    for (;;) {
+        sem_wait(&jack_gone);
+        if (jack_closing)
+            break;
+        fprintf(stderr, "JACK server gone, reconnecting\n");
+        if (retired) {
+            jack_client_close (retired);
+            retired = NULL;
+        }
+        jack_set_error_function (quiet_error);
+        while (!jack_closing) {
+            sleep(1);
+            if ((c = jack_open (JackNoStartServer)) == NULL)
+                continue;
+            for (t = 0; t < ntones; t++) {
+                sidetone_t *st = &sidetones[t];
+                atomic_store(&st->tail, atomic_load(&st->head));
+                st->tone.state = KEYED_TONE_OFF;
+                st->tone.until = -1;
+                element_stop(st);
+            }
+            if (jack_get_sample_rate (c) != sr)
+                srate (jack_get_sample_rate (c), NULL);
+            if (jack_activate (c)) {
+                jack_client_close (c);
+                continue;
+            }
+            retired = atomic_exchange(&client, c);
+            break;
+        }
+        jack_set_error_function (error);
+        if (jack_closing)
+            break;
+        jack_connect_ports ();
+        atomic_fetch_add(&keyer_stats->audio_restarts, 1);
+        printf("JACK server back, engine sample rate %u\n", jack_get_sample_rate (client));
+    }
+    return NULL;
+}
+
+int keyed_tone_start(long volume, double freq, int envelope, int window) {
+    jack_set_error_function (error);
+    sem_init(&jack_gone, 0, 0);
+
+    if ((client = jack_open (JackNullOption)) == NULL) {
+        fprintf(stderr, "jack server not running?\n");
+        return 1;
+    }
 
     /* display the current sample rate. once the client is activated
        (see below), you should rely on your own sample rate
        callback (see above) for this value.  */
     printf ("engine sample rate: %lu\n", jack_get_sample_rate (client));
 
-    output_port = jack_port_register (client, "output", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-
-    tone_opts.srate = jack_get_sample_rate (client);
-    keyed_tone_init(&tone, tone_opts.gain, tone_opts.freq, tone_opts.rise, tone_opts.fall, tone_opts.srate);
+    keyed_tone_attach(volume, freq, envelope, window, jack_get_sample_rate (client), jack_clock);
 
     /* tell the JACK server that we are ready to roll */
     if (jack_activate (client)) {
         fprintf (stderr, "cannot activate client\n");
         return 1;
     }
-
-    if ((ports = jack_get_ports (client, NULL, NULL, JackPortIsPhysical|JackPortIsInput)) == NULL) {
-        fprintf(stderr, "Cannot find any physical playback ports\n");
+    if (jack_connect_ports ())
         return 1;
-    }
-
-    if (jack_connect (client, jack_port_name (output_port), ports[0])) {
-        fprintf (stderr, "cannot connect output ports\n");
-    }
 
-    free (ports);
+    if (pthread_create(&reconnect_thread_id, NULL, reconnect_thread, NULL))
+        fprintf(stderr, "pthread_create for reconnect_thread failed, a JACK restart will silence the sidetone\n");
+    else
+        reconnecting = 1;
     return 0;
 }
@@ -97,15 +97,56 @@ Bridgewater, NJ 08807
 ** pulse length, and the keyed envelope would be smooth.
 **
 ** but you don't usually know the pulse length until key up.
+**
+** except that the keyer does, for every element but a straight key's, so
+** keyed_tone_on_for() takes it and the tone times its own fall, with no
+** decision left for the key up.
 */
 
 #include <string.h>
 #include <complex.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+** the oscillator and ramp tables are defined once, where this is
+** included with KEYED_TONE_STORAGE defined, keyed_tone.c or a program
+** built on the header alone, and only declared everywhere else.
+*/
+#ifdef KEYED_TONE_STORAGE
+#define KEYED_TONE_TABLE
+#else
+#define KEYED_TONE_TABLE extern
+#endif
 
-int keyed_tone_start(long volume, double freq, int envelope);
-extern int keyed_tone_mute;
+int keyed_tone_start(long volume, double freq, int envelope, int window);
+void keyed_tone_key(int id, int on);
+void keyed_tone_key_at(int id, int on, unsigned offset);
+/* a key down that comes up again after ticks at tick_rate, and its key up */
+void keyed_tone_key_for(int id, int on, unsigned ticks, unsigned tick_rate);
+void keyed_tone_key_for_at(int id, int on, unsigned ticks, unsigned tick_rate, unsigned offset);
+void keyed_tone_set(int id, long volume, double freq);
+void keyed_tone_set_clock(void (*clock)(unsigned nframes, unsigned sample_rate));
+void keyed_tone_set_period(unsigned nframes);
+void keyed_tone_set_midi(int note);
+void keyed_tone_set_ports(int channels, const char *regex);
+void keyed_tone_set_tones(int n);
+void keyed_tone_set_cache(int on);
+/* after ms of silence only zero the buffers until the next key event, 0 never */
+void keyed_tone_set_idle(int ms);
+/* the dot and dash the keyer will send, for the cache */
+void keyed_tone_set_elements(int id, unsigned dot_ticks, unsigned dash_ticks, unsigned tick_rate);
+
+/* for the sidetone backends */
+void keyed_tone_attach(long volume, double freq, int envelope, int window,
+                       unsigned sample_rate, uint32_t (*clock)(void));
+/* returns 1 if it only zeroed the buffers */
+int keyed_tone_render(float **out, int nout, void *midi, uint32_t base, unsigned nframes);
+/* the same as 16 bit samples, interleaved over nout channels */
+int keyed_tone_render_s16(int16_t *out, int nout, uint32_t base, unsigned nframes);
 void keyed_tone_close();
 
 static const float pi = 3.14159265358979323846f;		/* pi */
@@ -137,7 +178,7 @@ static double square(double x) {
     return x * x;
 }
 
-#if ! defined(OSCILLATOR_F) && ! defined(OSCILLATOR_T) && ! defined(OSCILLATOR_Z)
+#if ! defined(OSCILLATOR_F) && ! defined(OSCILLATOR_T) && ! defined(OSCILLATOR_Z) && ! defined(OSCILLATOR_R) && ! defined(OSCILLATOR_Q)
 #error "oscillator.h has no implementation selected"
 #endif
 
@@ -206,6 +247,12 @@ static float complex oscillator_process(oscillator_t *o) {
     return o->finish(x, y);
 }
 
+static void oscillator_process_block(oscillator_t *o, float *out, int n, float gain) {
+    int i;
+    for (i = 0; i < n; i += 1)
+        out[i] = gain * crealf(oscillator_process(o));
+}
+
 #endif
 
 #ifdef OSCILLATOR_T
@@ -230,6 +277,12 @@ static float complex oscillator_process(oscillator_t *o) {
     while (o->phase < -otwo_pi) o->phase += otwo_pi;
     return ocos(o->phase) + I * osin(o->phase);
 }
+
+static void oscillator_process_block(oscillator_t *o, float *out, int n, float gain) {
+    int i;
+    for (i = 0; i < n; i += 1)
+        out[i] = gain * crealf(oscillator_process(o));
+}
 #endif
 
 #ifdef OSCILLATOR_Z
@@ -238,11 +291,13 @@ static float complex oscillator_process(oscillator_t *o) {
 */
 typedef struct {
     ocomplex phase, dphase;
+    ocomplex dphase4;		/* dphase^4, for the block rotor */
 } oscillator_t;
 
 static void oscillator_set_hertz(oscillator_t *o, float hertz, int samples_per_second) {
     ofloat dradians = otwo_pi * hertz / samples_per_second;
     o->dphase = ocos(dradians) + I * osin(dradians);
+    o->dphase4 = ocos(4 * dradians) + I * osin(4 * dradians);
 }
 
 static void oscillator_set_phase(oscillator_t *o, float radians) {
@@ -253,6 +308,172 @@ static float complex oscillator_process(oscillator_t *o) {
     return o->phase *= o->dphase;
 }
 
+/*
+** the real part of the next n samples, scaled by gain.
+** four rotors a sample apart, each stepped by dphase^4, with the
+** real and imaginary parts kept in separate lanes so the compiler
+** can vectorise the inner loop.
+*/
+static void oscillator_process_block(oscillator_t *o, float *out, int n, float gain) {
+    ofloat re[4], im[4], t;
+    ofloat dr = creal(o->dphase4), di = cimag(o->dphase4);
+    ocomplex phase = o->phase;
+    int i, k;
+
+    if (n <= 0)
+        return;
+    for (k = 0; k < 4; k += 1) {
+        phase *= o->dphase;
+        re[k] = creal(phase);
+        im[k] = cimag(phase);
+    }
+    for (i = 0; i + 4 < n; i += 4) {
+        for (k = 0; k < 4; k += 1) {
+            out[i+k] = gain * re[k];
+            t = re[k] * dr - im[k] * di;
+            im[k] = re[k] * di + im[k] * dr;
+            re[k] = t;
+        }
+    }
+    for (k = 0; i + k < n; k += 1)
+        out[i+k] = gain * re[k];
+    o->phase = re[k-1] + I * im[k-1];
+}
+
+#endif
+
+#ifdef OSCILLATOR_R
+/*
+** oscillator - a real second order recursion
+** y[n] = 2 cos(w) y[n-1] - y[n-2], always in single precision.
+** there is no quadrature part, the imaginary part is always zero.
+** rounding makes the amplitude wander, so every OSCILLATOR_RENORM
+** samples it is pulled back using the invariant
+** y[n-1]^2 + y[n-2]^2 - 2 cos(w) y[n-1] y[n-2] == sin(w)^2
+*/
+#ifndef OSCILLATOR_RENORM
+#define OSCILLATOR_RENORM 1024
+#endif
+
+typedef struct {
+    float y1, y2;		/* the last two outputs */
+    float c2;			/* 2 cos(w) */
+    float e0;			/* sin(w)^2, the invariant at unit amplitude */
+    int count;			/* samples since the last renormalisation */
+} oscillator_t;
+
+static void oscillator_renormalise(oscillator_t *o) {
+    float e = o->y1 * o->y1 + o->y2 * o->y2 - o->c2 * o->y1 * o->y2;
+    o->count = 0;
+    if (e > 0) {
+        float g = sqrtf(o->e0 / e);
+        o->y1 *= g;
+        o->y2 *= g;
+    }
+}
+
+static void oscillator_set_hertz(oscillator_t *o, float hertz, int samples_per_second) {
+    float w = two_pi * hertz / samples_per_second;
+    o->c2 = 2 * cosf(w);
+    o->e0 = sqrf(sinf(w));
+    oscillator_renormalise(o);	/* keeps the amplitude across a retune */
+}
+
+static void oscillator_set_phase(oscillator_t *o, float radians) {
+    float w = acosf(o->c2 / 2);
+    o->y1 = cosf(radians);
+    o->y2 = cosf(radians - w);
+    o->count = 0;
+}
+
+static float complex oscillator_process(oscillator_t *o) {
+    float y = o->c2 * o->y1 - o->y2;
+    o->y2 = o->y1;
+    o->y1 = y;
+    if (++o->count >= OSCILLATOR_RENORM)
+        oscillator_renormalise(o);
+    return y;
+}
+
+static void oscillator_process_block(oscillator_t *o, float *out, int n, float gain) {
+    float y1 = o->y1, y2 = o->y2, c2 = o->c2, y;
+    int i;
+    for (i = 0; i < n; i += 1) {
+        y = c2 * y1 - y2;
+        y2 = y1;
+        y1 = y;
+        out[i] = gain * y;
+    }
+    o->y1 = y1;
+    o->y2 = y2;
+    o->count += n;
+    if (o->count >= OSCILLATOR_RENORM)
+        oscillator_renormalise(o);
+}
+#endif
+
+#ifdef OSCILLATOR_Q
+/*
+** oscillator - a 32 bit phase accumulator and a Q15 cosine table, so
+** integer only once it is set up, for cores with a weak FPU or none.
+** the top OSCILLATOR_Q_BITS of the phase index the table and the next
+** 15 interpolate between neighbours.  the float calls are there so the
+** rest of the file works unchanged, oscillator_process_q15() is the
+** one keyed_tone_process_block_s16() uses.
+*/
+#ifndef OSCILLATOR_Q_BITS
+#define OSCILLATOR_Q_BITS 10
+#endif
+#define OSCILLATOR_Q_SIZE (1 << OSCILLATOR_Q_BITS)
+
+/* cos over a turn, one more point for the interpolation, built once */
+KEYED_TONE_TABLE int16_t oscillator_q_table[OSCILLATOR_Q_SIZE + 1];
+
+typedef struct {
+    uint32_t phase, dphase;	/* 2^32 is a turn */
+} oscillator_t;
+
+static void oscillator_q_table_build() {
+    int i;
+    if (oscillator_q_table[0] != 0)
+        return;
+    for (i = 0; i <= OSCILLATOR_Q_SIZE; i += 1)
+        oscillator_q_table[i] = lrint(32767 * cos(dtwo_pi * i / OSCILLATOR_Q_SIZE));
+}
+
+static void oscillator_set_hertz(oscillator_t *o, float hertz, int samples_per_second) {
+    oscillator_q_table_build();
+    o->dphase = (uint32_t)(int64_t)llrint((double)hertz / samples_per_second * 4294967296.0);
+}
+
+static void oscillator_set_phase(oscillator_t *o, float radians) {
+    o->phase = (uint32_t)(int64_t)llrint(fmod(radians, dtwo_pi) / dtwo_pi * 4294967296.0);
+}
+
+/* the table at a phase, interpolated */
+static int32_t oscillator_q15_at(uint32_t phase) {
+    uint32_t i = phase >> (32 - OSCILLATOR_Q_BITS);
+    int32_t f = (phase >> (32 - OSCILLATOR_Q_BITS - 15)) & 0x7fff;
+    int32_t a = oscillator_q_table[i], b = oscillator_q_table[i+1];
+    return a + (((b - a) * f) >> 15);
+}
+
+/* the real part of the next sample in Q15 */
+static int32_t oscillator_process_q15(oscillator_t *o) {
+    return oscillator_q15_at(o->phase += o->dphase);
+}
+
+static float complex oscillator_process(oscillator_t *o) {
+    uint32_t phase = o->phase += o->dphase;
+    return (oscillator_q15_at(phase) + I * oscillator_q15_at(phase - 0x40000000u)) * (1.0f / 32768);
+}
+
+static void oscillator_process_block(oscillator_t *o, float *out, int n, float gain) {
+    int i;
+    gain *= 1.0f / 32768;
+    for (i = 0; i < n; i += 1)
+        out[i] = gain * oscillator_process_q15(o);
+}
 #endif
 
 /*
@@ -324,6 +545,25 @@ static char *window_names[] = {
     NULL
 };
 
+static window_type_t window_lookup(const char *name) {
+    int i;
+    for (i = 0; window_names[i] != NULL; i += 1)
+        if (strcmp(window_names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+/* modified bessel function of the first kind, order 0, for the kaiser window */
+static double bessel_i0(double x) {
+    double sum = 1, term = 1;
+    int k;
+    for (k = 1; k < 50 && term > 1e-12 * sum; k += 1) {
+        term *= sqr(x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
 /* -------------------------------------------------------------------------- */
 /** @brief Function to make the window
 *
@@ -430,14 +670,21 @@ static float window_get(const window_type_t type, const int size, int k) {
     case WINDOW_TUKEY: {
         // Tukey window is an interpolation between a Hann and a rectangular window
         // parameterized by alpha, somewhat like a raised cosine keyed tone
-        return 0;
+        const double alpha = 0.5;
+        const double edge = alpha * (size-1) / 2;
+        if (k > (size-1) / 2) k = (size-1) - k;
+        if (k >= edge) return 1.0;
+        return 0.5 - 0.5 * cos(dpi * k / edge);
     }
     case WINDOW_COSINE: {
         // also known as the sine window
         return sin(pi*k / (size-1));
     }
     case WINDOW_LANCZOS: {
-        return 0;// sinc(2*k/(size-1)), normalized sinc(x) = sin(pi x) / (pi x), sinc(0) == 1
+        // sinc(2*k/(size-1) - 1), normalized sinc(x) = sin(pi x) / (pi x), sinc(0) == 1
+        const double x = 2.0 * k / (size-1) - 1.0;
+        if (x == 0) return 1.0;
+        return sin(dpi * x) / (dpi * x);
     }
     case WINDOW_TRIANGULAR: {
         return 2.0 / (size+1) * ((size+1)/2.0 - fabs(k-(size-1)/2.0));
@@ -448,18 +695,23 @@ static float window_get(const window_type_t type, const int size, int k) {
         return exp(-0.5 * pow((k - (size-1) / 2.0) / (sigma * (size-1) / 2.0), 2));
     }
     case WINDOW_BARTLETT_HANN: {
-        return 0;
+        const double a0 = 0.62, a1 = 0.48, a2 = 0.38;
+        const double x = (double)k / (size-1);
+        return a0 - a1 * fabs(x - 0.5) - a2 * cos(dtwo_pi * x);
     }
     case WINDOW_KAISER: {
-        return 0;
+        // kaiser parameterized by beta, 8.6 is close to a blackman
+        const double beta = 8.6;
+        const double x = 2.0 * k / (size-1) - 1.0;
+        return bessel_i0(beta * sqrt(1 - x * x)) / bessel_i0(beta);
     }
     }
     return 1.0 / 0.0;
 }
 
 /*
-** Blackman Harris attack/decay ramp
-** uses 1/2 of the Blackman Harris window function
+** attack/decay ramp
+** uses 1/2 of a window function, Blackman Harris by default
 ** from sin(0 .. 0.5) for ramp on
 ** from sin(0.5 .. 1.0) for ramp off
 */
@@ -467,23 +719,164 @@ typedef struct {
     int do_rise;			/* rising or falling ramp */
     int target;			/* sample length of ramp */
     int current;			/* current sample point in ramp */
-    float *ramp;			/* ramp values */
+    const float *ramp;		/* ramp values, owned by the ramp cache */
+#ifdef OSCILLATOR_Q
+    const uint16_t *ramp_q15;	/* and in Q15 */
+#endif
 } ramp_t;
 
-static void ramp_update(ramp_t *r, float ms, int samples_per_second) {
+/*
+** ramp tables, cached by window and length in samples, which covers
+** the envelope and the sample rate, and carved out of a fixed arena so
+** nothing is ever allocated or freed.  tables are only ever added, under
+** ramp_cache_lock, as main, JACK's notification thread and the reconnect
+** thread can all build one, and published by the release on
+** ramp_cache_count, so ramp_table() takes no lock and is safe from the
+** audio thread.
+*/
+#ifndef RAMP_CACHE_SLOTS
+#define RAMP_CACHE_SLOTS 32
+#endif
+#ifndef RAMP_ARENA_POINTS
+#define RAMP_ARENA_POINTS (64*1024)	/* 340 ms at 192 kHz, in all */
+#endif
+
+typedef struct {
+    window_type_t window;
+    int target;
+    const float *ramp;
+} ramp_cache_slot_t;
+
+KEYED_TONE_TABLE ramp_cache_slot_t ramp_cache[RAMP_CACHE_SLOTS];
+KEYED_TONE_TABLE atomic_int ramp_cache_count;
+KEYED_TONE_TABLE float ramp_arena[RAMP_ARENA_POINTS];
+KEYED_TONE_TABLE int ramp_arena_used;
+#ifdef KEYED_TONE_STORAGE
+pthread_mutex_t ramp_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+extern pthread_mutex_t ramp_cache_lock;
+#endif
+
+/* the single point table behind a hard keyed ramp of length 1 */
+static const float ramp_step[1] = { 1.0f };
+
+#ifdef OSCILLATOR_Q
+/* every table again in Q15, 32768 is 1, at the same offset as in ramp_arena */
+KEYED_TONE_TABLE uint16_t ramp_arena_q15[RAMP_ARENA_POINTS];
+static const uint16_t ramp_step_q15[1] = { 32768 };
+#endif
+
+static int ramp_length(float ms, int samples_per_second) {
+    int target = samples_per_second * (ms / 1000.0f);
+    if (target < 1) target = 1;
+    if ((target & 1) == 0) target += 1;
+    return target;
+}
+
+/* the rising half of the window, scaled to end at exactly 1 */
+static void ramp_build(float *ramp, window_type_t window, int target) {
     int i;
-    r->target = samples_per_second * (ms / 1000.0f);
-    if (r->target < 1) r->target = 1;
-    if ((r->target & 1) == 0) r->target += 1;
+    float peak;
+    for (i = 0; i < target; i += 1)
+        ramp[i] = window_get(window, 2*target-1, i);
+    peak = ramp[target-1];
+    if (peak != 0 && peak != 1)
+        for (i = 0; i < target; i += 1)
+            ramp[i] /= peak;
+}
+
+/* a cached table, or NULL, never builds one, safe from the audio thread */
+static const float *ramp_table(window_type_t window, int target) {
+    int i, n = atomic_load_explicit(&ramp_cache_count, memory_order_acquire);
+    if (target == 1)
+        return ramp_step;
+    for (i = 0; i < n; i += 1)
+        if (ramp_cache[i].window == window && ramp_cache[i].target == target)
+            return ramp_cache[i].ramp;
+    return NULL;
+}
+
+/*
+** a cached table, building it if need be, NULL if the cache is full.
+** never from the audio thread, it may wait on the lock.
+*/
+static const float *ramp_prepare(window_type_t window, int target) {
+    const float *ramp = ramp_table(window, target);
+    float *fresh;
+    int n;
+#ifdef OSCILLATOR_Q
+    int i;
+#endif
+
+    if (ramp != NULL)
+        return ramp;
+    pthread_mutex_lock(&ramp_cache_lock);
+    /* another thread may have built it whilst this one waited */
+    if ((ramp = ramp_table(window, target)) != NULL) {
+        pthread_mutex_unlock(&ramp_cache_lock);
+        return ramp;
+    }
+    n = atomic_load_explicit(&ramp_cache_count, memory_order_relaxed);
+    if (n == RAMP_CACHE_SLOTS || ramp_arena_used + target > RAMP_ARENA_POINTS) {
+        pthread_mutex_unlock(&ramp_cache_lock);
+        return NULL;
+    }
+    fresh = ramp_arena + ramp_arena_used;
+    ramp_build(fresh, window, target);
+#ifdef OSCILLATOR_Q
+    for (i = 0; i < target; i += 1)
+        ramp_arena_q15[ramp_arena_used + i] = lrintf(fresh[i] * 32768);
+#endif
+    ramp_arena_used += target;
+    ramp_cache[n].window = window;
+    ramp_cache[n].target = target;
+    ramp_cache[n].ramp = fresh;
+    atomic_store_explicit(&ramp_cache_count, n+1, memory_order_release);
+    pthread_mutex_unlock(&ramp_cache_lock);
+    return fresh;
+}
+
+#ifdef OSCILLATOR_Q
+/* the Q15 twin of a table from the cache */
+static const uint16_t *ramp_q15_table(const float *ramp) {
+    if (ramp == ramp_step)
+        return ramp_step_q15;
+    return ramp_arena_q15 + (ramp - ramp_arena);
+}
+#endif
+
+/*
+** point the ramp at the table for ms at samples_per_second, building it
+** if build is set.  returns -1, leaving the ramp as it was, if the table
+** isn't there.  a ramp with no table at all falls back to a hard key.
+*/
+static int ramp_update(ramp_t *r, window_type_t window, float ms, int samples_per_second, int build) {
+    int target = ramp_length(ms, samples_per_second);
+    const float *ramp = build ? ramp_prepare(window, target) : ramp_table(window, target);
+
+    if (ramp == NULL) {
+        if (r->ramp == NULL) {
+            r->target = 1;
+            r->ramp = ramp_step;
+#ifdef OSCILLATOR_Q
+            r->ramp_q15 = ramp_step_q15;
+#endif
+        }
+        return -1;
+    }
+    r->target = target;
     r->current = 0;
-    r->ramp = realloc(r->ramp, r->target*sizeof(float));
-    for (i = 0; i < r->target; i += 1)
-        r->ramp[i] = window_get(WINDOW_BLACKMAN_HARRIS, 2*r->target-1, i);
+    r->ramp = ramp;
+#ifdef OSCILLATOR_Q
+    r->ramp_q15 = ramp_q15_table(ramp);
+#endif
+    return 0;
 }
 
-static void ramp_init(ramp_t *r, float ms, int samples_per_second) {
+static int ramp_init(ramp_t *r, window_type_t window, float ms, int samples_per_second) {
     r->ramp = NULL;
-    ramp_update(r, ms, samples_per_second);
+    r->current = 0;
+    return ramp_update(r, window, ms, samples_per_second, 1);
 }
 
 static void ramp_start_rise(ramp_t *r) {
@@ -506,9 +899,58 @@ static int ramp_done(ramp_t *r) {
     return r->current >= r->target;
 }
 
-static void ramp_free(ramp_t *r) {
-    if (r->ramp != NULL) free(r->ramp);
+/*
+** multiply the next n samples of buf by gain and the ramp,
+** stopping when the ramp is done.  returns the number of samples used.
+*/
+static int ramp_apply_block(ramp_t *r, float *buf, int n, float gain) {
+    const float *v = r->ramp + r->current + 1;
+    int m = r->target - r->current;
+    int k, j;
+
+    if (m > n) m = n;
+    k = (r->current + m < r->target) ? m : m - 1;	/* points from the table */
+    if (r->do_rise)
+        for (j = 0; j < k; j += 1)
+            buf[j] *= gain * v[j];
+    else
+        for (j = 0; j < k; j += 1)
+            buf[j] *= gain * (1 - v[j]);
+    if (k < m)			/* the point past the end of the table */
+        buf[k] *= r->do_rise ? gain : 0;
+    r->current += m;
+    return m;
+}
+
+/* a sample in Q15 times a gain in Q16, saturated to 16 bits */
+static int16_t q15_scale(int32_t x, int32_t gain) {
+    int64_t y = ((int64_t)x * gain) >> 16;
+    return y > 32767 ? 32767 : y < -32768 ? -32768 : y;
+}
+
+#ifdef OSCILLATOR_Q
+/* ramp_apply_block() for the integer renderer, the tone and ramp in one */
+static int ramp_apply_block_s16(ramp_t *r, oscillator_t *o, int16_t *buf, int n, int32_t gain) {
+    const uint16_t *v = r->ramp_q15 + r->current + 1;
+    int m = r->target - r->current;
+    int k, j;
+
+    if (m > n) m = n;
+    k = (r->current + m < r->target) ? m : m - 1;
+    if (r->do_rise)
+        for (j = 0; j < k; j += 1)
+            buf[j] = q15_scale((oscillator_process_q15(o) * v[j]) >> 15, gain);
+    else
+        for (j = 0; j < k; j += 1)
+            buf[j] = q15_scale((oscillator_process_q15(o) * (32768 - v[j])) >> 15, gain);
+    if (k < m) {		/* the point past the end of the table */
+        int32_t x = oscillator_process_q15(o);
+        buf[k] = r->do_rise ? q15_scale(x, gain) : 0;
+    }
+    r->current += m;
+    return m;
 }
+#endif
 
 #define KEYED_TONE_OFF	0	/* note is not sounding */
 #define KEYED_TONE_RISE	1	/* note is ramping up to full level */
@@ -521,34 +963,67 @@ typedef struct {
     oscillator_t tone;		/* tone oscillator */
     ramp_t rise;			/* tone on ramp */
     ramp_t fall;			/* tone off ramp */
+    int until;			/* samples to the fall of a timed key down, or -1 */
+    int32_t qgain;		/* gain in Q16, for keyed_tone_process_block_s16() */
 } keyed_tone_t;
 
-static void keyed_tone_update(keyed_tone_t *p, float gain_dB, float freq, float rise, float fall, unsigned sample_rate) {
+static void keyed_tone_set_gain(keyed_tone_t *p, float gain_dB) {
     p->gain = powf(10.0f, gain_dB / 20.0f);
+    p->qgain = lrintf(p->gain * 65536);
+}
+
+/*
+** only swaps ramp tables, so it is safe from the audio thread while the
+** tone is off provided the tables were prepared beforehand.  returns -1
+** if they weren't, with the ramps left as they were.
+*/
+static int keyed_tone_update(keyed_tone_t *p, float gain_dB, float freq, window_type_t window, float rise, float fall, unsigned sample_rate) {
+    keyed_tone_set_gain(p, gain_dB);
     oscillator_update(&p->tone, freq, sample_rate);
-    ramp_update(&p->rise, rise, sample_rate);
-    ramp_update(&p->fall, fall, sample_rate);
+    return (ramp_update(&p->rise, window, rise, sample_rate, 0) |
+            ramp_update(&p->fall, window, fall, sample_rate, 0));
 }
 
-static void *keyed_tone_init(keyed_tone_t *p, float gain_dB, float freq, float rise, float fall, unsigned sample_rate) {
+/* builds the ramp tables it needs, so not from the audio thread */
+static void *keyed_tone_init(keyed_tone_t *p, float gain_dB, float freq, window_type_t window, float rise, float fall, unsigned sample_rate) {
     p->state = KEYED_TONE_OFF;
-    p->gain = powf(10.0f, gain_dB / 20.0f);
+    p->until = -1;
+    keyed_tone_set_gain(p, gain_dB);
     oscillator_init(&p->tone, freq, 0.0f, sample_rate);
-    ramp_init(&p->rise, rise, sample_rate);
-    ramp_init(&p->fall, fall, sample_rate);
+    ramp_init(&p->rise, window, rise, sample_rate);
+    ramp_init(&p->fall, window, fall, sample_rate);
     return p;
 }
 
 static void keyed_tone_on(keyed_tone_t *p) {
     p->state = KEYED_TONE_RISE;
+    p->until = -1;
     ramp_start_rise(&p->rise);
 }
 
 static void keyed_tone_off(keyed_tone_t *p) {
     p->state = KEYED_TONE_FALL;
+    p->until = -1;
     ramp_start_fall(&p->fall);
 }
 
+/* key down for the next samples, then fall off by itself */
+static void keyed_tone_on_for(keyed_tone_t *p, int samples) {
+    keyed_tone_on(p);
+    if (samples > 0)
+        p->until = samples;
+}
+
+/* the frames left to a timed fall limit a run of rise or sustain */
+static int keyed_tone_timed(keyed_tone_t *p, int m) {
+    return (p->until >= 0 && p->until < m) ? p->until : m;
+}
+
+static void keyed_tone_count(keyed_tone_t *p, int m) {
+    if (p->until >= 0 && (p->until -= m) == 0)
+        keyed_tone_off(p);
+}
+
 static float _Complex keyed_tone_process(keyed_tone_t *p) {
     float scale = p->gain;
     switch (p->state) {
@@ -559,8 +1034,10 @@ static float _Complex keyed_tone_process(keyed_tone_t *p) {
         scale *= ramp_next(&p->rise);
         if (ramp_done(&p->rise))
             p->state = KEYED_TONE_ON;
+        keyed_tone_count(p, 1);
         break;
     case KEYED_TONE_ON:	/* note is sounding full level */
+        keyed_tone_count(p, 1);
         break;
     case KEYED_TONE_FALL:	/* note is ramping down to off */
         scale *= ramp_next(&p->fall);
@@ -570,4 +1047,114 @@ static float _Complex keyed_tone_process(keyed_tone_t *p) {
     }
     return scale * oscillator_process(&p->tone);
 }
+
+/*
+** render n samples of the real part in runs of constant state:
+** silence is a memset, sustain is the block rotor, and the ramps
+** are the block rotor multiplied by the ramp table.
+*/
+static void keyed_tone_process_block(keyed_tone_t *p, float *out, int n) {
+    int i = 0, m;
+    while (i < n) {
+        switch (p->state) {
+        case KEYED_TONE_OFF:
+            memset(out+i, 0, (n-i) * sizeof(float));
+            return;
+        case KEYED_TONE_ON:
+            m = keyed_tone_timed(p, n-i);
+            oscillator_process_block(&p->tone, out+i, m, p->gain);
+            i += m;
+            keyed_tone_count(p, m);
+            break;
+        case KEYED_TONE_RISE:
+            m = p->rise.target - p->rise.current;
+            if (m > n-i) m = n-i;
+            m = keyed_tone_timed(p, m);
+            oscillator_process_block(&p->tone, out+i, m, 1.0f);
+            m = ramp_apply_block(&p->rise, out+i, m, p->gain);
+            i += m;
+            if (ramp_done(&p->rise))
+                p->state = KEYED_TONE_ON;
+            keyed_tone_count(p, m);
+            break;
+        case KEYED_TONE_FALL:
+            m = p->fall.target - p->fall.current;
+            if (m > n-i) m = n-i;
+            oscillator_process_block(&p->tone, out+i, m, 1.0f);
+            i += ramp_apply_block(&p->fall, out+i, m, p->gain);
+            if (ramp_done(&p->fall))
+                p->state = KEYED_TONE_OFF;
+            break;
+        }
+    }
+}
+
+/*
+** keyed_tone_process_block() as 16 bit samples, saturated.  with
+** OSCILLATOR_Q it is integer from end to end, the same state machine
+** with Q15 tones and ramps, otherwise it converts the float block.
+*/
+#ifdef OSCILLATOR_Q
+static void keyed_tone_process_block_s16(keyed_tone_t *p, int16_t *out, int n) {
+    int i = 0, j, m;
+    while (i < n) {
+        switch (p->state) {
+        case KEYED_TONE_OFF:
+            memset(out+i, 0, (n-i) * sizeof(int16_t));
+            return;
+        case KEYED_TONE_ON:
+            m = keyed_tone_timed(p, n-i);
+            for (j = 0; j < m; j += 1)
+                out[i+j] = q15_scale(oscillator_process_q15(&p->tone), p->qgain);
+            i += m;
+            keyed_tone_count(p, m);
+            break;
+        case KEYED_TONE_RISE:
+            m = keyed_tone_timed(p, n-i);
+            m = ramp_apply_block_s16(&p->rise, &p->tone, out+i, m, p->qgain);
+            i += m;
+            if (ramp_done(&p->rise))
+                p->state = KEYED_TONE_ON;
+            keyed_tone_count(p, m);
+            break;
+        case KEYED_TONE_FALL:
+            i += ramp_apply_block_s16(&p->fall, &p->tone, out+i, n-i, p->qgain);
+            if (ramp_done(&p->fall))
+                p->state = KEYED_TONE_OFF;
+            break;
+        }
+    }
+}
+#else
+static void keyed_tone_process_block_s16(keyed_tone_t *p, int16_t *out, int n) {
+    float buf[64];
+    int i, j, m;
+    for (i = 0; i < n; i += m) {
+        m = (n-i < 64) ? n-i : 64;
+        keyed_tone_process_block(p, buf, m);
+        for (j = 0; j < m; j += 1) {
+            float v = buf[j] * 32768;
+            out[i+j] = v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t)v;
+        }
+    }
+}
+#endif
+
+/*
+** the whole of a key down lasting samples, from the start of the rise
+** to the end of the fall, with the oscillator starting from phase 0, so
+** sample k of it has the phase a tone restarted at k * 2 pi freq / rate
+** would.  p must be off.  returns the samples rendered, or -1 if that is
+** more than max.
+*/
+static int keyed_tone_render_element(keyed_tone_t *p, float *buf, int max, int samples) {
+    int n = samples + p->fall.target;
+
+    if (n > max)
+        return -1;
+    oscillator_reset(&p->tone);
+    keyed_tone_on_for(p, samples);
+    keyed_tone_process_block(p, buf, n);
+    return n;
+}
 #endif
@@ -0,0 +1,612 @@
+/*
+
+    iambic keyer state machine, adapted from Phil Harman VK6PH's
+    iambic.v for the openHPSDR Hermes, see iambic.c for the details.
+
+    nothing in here touches GPIO or a clock: paddles come in through
+    keyer_paddle(), the key goes out through the output function handed
+    to keyer_init(), and time only passes when a driver calls
+    keyer_tick() or keyer_run() with however many ticks have elapsed.
+
+    all of a keyer's state is in its keyer_t, so a driver can run as
+    many keyers as it has paddles.
+
+*/
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "keyer.h"
+
+
+enum {
+    CHECK = 0,
+    PREDOT,
+    PREDASH,
+    SENDDOT,
+    SENDDASH,
+    DOTDELAY,
+    DASHDELAY,
+    DOTHELD,
+    DASHHELD,
+    LETTERSPACE,
+    TEXTMARK,
+    TEXTSPACE,
+    PTTLEAD,
+    PTTTAIL,
+    EXITLOOP
+};
+
+static void select_step(keyer_t *k);
+
+// idle, with the default settings and the original 1 ms clock
+void keyer_init(keyer_t *k, void (*output)(void *arg, int state), void *arg) {
+    memset(k, 0, sizeof(*k));
+    k->speed = 20;
+    k->weight = 55;
+    k->mode = KEYER_MODE_B;
+    k->breakin = 1;
+    k->tick_rate = 1000;
+    k->output = output;
+    k->arg = arg;
+    k->state = EXITLOOP;
+    select_step(k);
+}
+
+void keyer_set_boundary(keyer_t *k, void (*boundary)(void *arg)) {
+    k->boundary = boundary;
+}
+
+// ptt is called with 1 lead_us before the first key down, and with 0
+// tail_us after the last key up, unless the keyer is keyed again first
+void keyer_set_ptt(keyer_t *k, void (*ptt)(void *arg, int state), int lead_us, int tail_us) {
+    k->ptt = ptt;
+    k->ptt_lead_us = lead_us;
+    k->ptt_tail_us = tail_us;
+}
+
+void keyer_set_clock(keyer_t *k, unsigned tick_rate, int exact) {
+    k->tick_rate = tick_rate;
+    k->exact = exact;
+}
+
+unsigned keyer_get_tick_rate(keyer_t *k) {
+    return k->tick_rate;
+}
+
+int keyer_dot_ticks(keyer_t *k) {
+    return k->dot_delay;
+}
+
+int keyer_dash_ticks(keyer_t *k) {
+    return k->dash_delay;
+}
+
+int keyer_mark(keyer_t *k) {
+    return k->mark;
+}
+
+void keyer_update(keyer_t *k) {
+    if (!k->exact) {
+        k->dot_delay = 1200 / k->speed;
+        // will be 3 * dot length at standard weight
+        k->dash_delay = (k->dot_delay * 3 * k->weight) / 50;
+        k->ptt_lead = k->ptt_lead_us / 1000;
+        k->ptt_tail = k->ptt_tail_us / 1000;
+    }
+    else {
+        // same, but in ticks and only rounded once
+        double dot = k->tick_rate * 1.2 / k->speed;
+        k->dot_delay = lround(dot);
+        k->dash_delay = lround(dot * 3 * k->weight / 50);
+        k->ptt_lead = (int64_t)k->ptt_lead_us * k->tick_rate / 1000000;
+        k->ptt_tail = (int64_t)k->ptt_tail_us * k->tick_rate / 1000000;
+    }
+
+    select_step(k);
+}
+
+// safe from any thread, the release pairs with the acquire in
+// sample_paddles()
+void keyer_paddle(keyer_t *k, int right, int state) {
+    int bit = right ? 2 : 1;
+
+    if (state) {
+        atomic_fetch_or_explicit(&k->paddles, bit, memory_order_release);
+        atomic_fetch_or_explicit(&k->pressed, bit, memory_order_release);
+    }
+    else
+        atomic_fetch_and_explicit(&k->paddles, ~bit, memory_order_release);
+}
+
+// The hold-off runs from the last change the keyer took, and is the
+// make one while the paddle is closed.
+static int debounce_held(keyer_debounce_t *d, uint32_t now, uint32_t make_us, uint32_t break_us, uint32_t *wait) {
+    uint32_t hold = d->state ? make_us : break_us;
+
+    if (now - d->tick >= hold)
+        return 0;
+    *wait = hold - (now - d->tick);
+    return 1;
+}
+
+int keyer_debounce_edge(keyer_debounce_t *d, int state, uint32_t tick,
+                        uint32_t make_us, uint32_t break_us, uint32_t *wait) {
+    d->raw = state;
+    d->raw_tick = tick;
+    if (state == d->state)
+        return 0;
+    if (debounce_held(d, tick, make_us, break_us, wait))
+        return -1;
+    d->state = state;
+    d->tick = tick;
+    return 1;
+}
+
+// The level held back has been there since its edge, so it's applied
+// as of then, not as of the end of the hold-off.
+int keyer_debounce_settle(keyer_debounce_t *d, uint32_t now,
+                          uint32_t make_us, uint32_t break_us, uint32_t *wait) {
+    if (d->raw == d->state)
+        return 0;
+    if (debounce_held(d, now, make_us, break_us, wait))
+        return -1;
+    d->state = d->raw;
+    d->tick = d->raw_tick;
+    return 1;
+}
+
+// a paddle is closed for this tick if it is now, or has been since the
+// last one
+static void sample_paddles(keyer_t *k) {
+    int p = atomic_exchange_explicit(&k->pressed, 0, memory_order_acquire) |
+            atomic_load_explicit(&k->paddles, memory_order_acquire);
+
+    k->paddle[0] = p & 1;
+    k->paddle[1] = (p >> 1) & 1;
+}
+
+int keyer_idle(keyer_t *k) {
+    return k->state == EXITLOOP;
+}
+
+void keyer_start(keyer_t *k) {
+    k->state = CHECK;
+}
+
+int keyer_text_push(keyer_t *k, int mark_us, int space_us) {
+    unsigned head = atomic_load_explicit(&k->text_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&k->text_tail, memory_order_acquire);
+
+    if (head - tail >= TEXT_QUEUE_SIZE)
+        return -1;
+    k->text_queue[head & (TEXT_QUEUE_SIZE-1)].mark = mark_us;
+    k->text_queue[head & (TEXT_QUEUE_SIZE-1)].space = space_us;
+    atomic_store_explicit(&k->text_head, head+1, memory_order_release);
+    return 0;
+}
+
+void keyer_send(keyer_t *k, const keyer_message_t *m) {
+    atomic_store(&k->message_req, m);
+}
+
+// message is set before message_req is cleared, so m is always in one of them
+int keyer_sending(keyer_t *k, const keyer_message_t *m) {
+    return atomic_load(&k->message_req) == m || atomic_load(&k->message) == m;
+}
+
+// take a message handed over, and step into and out of its serial number
+static const keyer_element_t *message_peek(keyer_t *k) {
+    const keyer_message_t *m = atomic_load_explicit(&k->message_req, memory_order_relaxed);
+    const keyer_element_t *e;
+
+    if (m != NULL) {
+        atomic_store(&k->message, m);
+        atomic_compare_exchange_strong(&k->message_req, &m, NULL);
+        k->message_at = m->text;
+        k->message_resume = NULL;
+    }
+    m = atomic_load_explicit(&k->message, memory_order_relaxed);
+    if (m == NULL)
+        return NULL;
+    for (;;) {
+        e = k->message_at;
+        if (e->mark == KEYER_ELEMENT_SERIAL && m->serial != NULL && k->message_resume == NULL) {
+            k->message_resume = e + 1;
+            k->message_at = m->serial;
+        }
+        else if (e->mark == KEYER_ELEMENT_SERIAL)
+            k->message_at++;
+        else if (e->mark == KEYER_ELEMENT_END && k->message_resume != NULL) {
+            k->message_at = k->message_resume;
+            k->message_resume = NULL;
+        }
+        else if (e->mark == KEYER_ELEMENT_END) {
+            atomic_store(&k->message, NULL);
+            return NULL;
+        }
+        else
+            return e;
+    }
+}
+
+static int text_ready(keyer_t *k) {
+    return message_peek(k) != NULL ||
+           atomic_load_explicit(&k->text_head, memory_order_acquire) !=
+           atomic_load_explicit(&k->text_tail, memory_order_relaxed);
+}
+
+// text_ready() first
+static void text_next(keyer_t *k) {
+    unsigned tail = atomic_load_explicit(&k->text_tail, memory_order_relaxed);
+    const keyer_element_t *e = message_peek(k);
+
+    if (e != NULL) {
+        k->text_mark = e->mark == KEYER_ELEMENT_DOT ? k->dot_delay :
+                       e->mark == KEYER_ELEMENT_DASH ? k->dash_delay : 0;
+        k->text_space = e->space * k->dot_delay;
+        k->message_at++;
+        return;
+    }
+    k->text_mark = (int64_t)k->text_queue[tail & (TEXT_QUEUE_SIZE-1)].mark * k->tick_rate / 1000000;
+    k->text_space = (int64_t)k->text_queue[tail & (TEXT_QUEUE_SIZE-1)].space * k->tick_rate / 1000000;
+    atomic_store_explicit(&k->text_tail, tail+1, memory_order_release);
+}
+
+static void text_flush(keyer_t *k) {
+    const keyer_message_t *m = atomic_load_explicit(&k->message_req, memory_order_relaxed);
+
+    atomic_store_explicit(&k->text_tail, atomic_load_explicit(&k->text_head, memory_order_acquire),
+                          memory_order_release);
+    if (m != NULL)
+        atomic_compare_exchange_strong(&k->message_req, &m, NULL);
+    atomic_store(&k->message, NULL);
+}
+
+int keyer_polling(keyer_t *k) {
+    return !((k->state == TEXTMARK || k->state == TEXTSPACE) && !k->breakin);
+}
+
+static void key_out(keyer_t *k, int state) {
+    k->key = state;
+    k->output(k->arg, state);
+}
+
+// done, but PTT hangs on for the tail after the key comes up
+static void keyer_exit(keyer_t *k) {
+    k->delay = 0;
+    k->state = (k->ptt_on && !k->key) ? PTTTAIL : EXITLOOP;
+}
+
+// whether CHECK is about to key
+static int keying(keyer_t *k) {
+    return k->paddle[0] || k->paddle[1] || text_ready(k);
+}
+
+static void clear_memory(keyer_t *k) {
+    k->dot_memory  = 0;
+    k->dash_memory = 0;
+}
+
+// One tick of the state machine for a mode and paddle order.  Both are
+// constants wherever it is used, so each step function below is this with
+// the mode tests folded away and the paddles read once from paddle[].
+static inline __attribute__((always_inline)) void keyer_step(keyer_t *k, const int mode, const int reversed) {
+    int dot = k->paddle[reversed], dash = k->paddle[!reversed];
+
+    switch(k->state) {
+    case CHECK: // check for key press
+        if (k->boundary)                    // between elements, safe to change the timing
+            k->boundary(k->arg);
+        if (k->ptt && !k->ptt_on && keying(k)) {
+            k->ptt_on = 1;
+            k->ptt(k->arg, 1);
+            if (k->ptt_lead > 0) {          // hold the paddles until the amplifier has switched
+                k->lead_pressed = k->paddle[0] | (k->paddle[1] << 1);
+                k->state = PTTLEAD;
+                break;
+            }
+        }
+        if (text_ready(k)) {                 // text goes first unless a paddle breaks in
+            if (!k->breakin || !(dot || dash)) {
+                text_next(k);
+                k->mark = k->text_mark;
+                k->state = TEXTMARK;
+                break;
+            }
+            text_flush(k);
+        }
+        if (mode == KEYER_STRAIGHT) {       // Straight/External key or bug
+            if (dash) {                  // send manual dashes
+                k->mark = 0;                 // as long as the operator likes
+                key_out(k, 1);
+                keyer_exit(k);
+            }
+            else if (dot)                // and automatic dots
+                k->state = PREDOT;
+            else {
+                key_out(k, 0);
+                keyer_exit(k);
+            }
+        }
+        else {
+            if (dot)
+                k->state = PREDOT;
+            else if (dash)
+                k->state = PREDASH;
+            else {
+                key_out(k, 0);
+                keyer_exit(k);
+            }
+        }
+        break;
+    case PREDOT:                         // need to clear any pending dots or dashes
+        clear_memory(k);
+        k->mark = k->dot_delay;
+        k->state = SENDDOT;
+        break;
+    case PREDASH:
+        clear_memory(k);
+        k->mark = k->dash_delay;
+        k->state = SENDDASH;
+        break;
+
+    // dot paddle  pressed so set keyer_out high for time dependant on speed
+    // also check if dash paddle is pressed during this time
+    case SENDDOT:
+        key_out(k, 1);
+        if (k->delay == k->dot_delay) {
+            k->delay = 0;
+            key_out(k, 0);
+            k->state = DOTDELAY;        // add inter-character spacing of one dot length
+        }
+        else k->delay++;
+
+        // if Mode A and both paddels are relesed then clear dash memory
+        if (mode == KEYER_MODE_A)
+            if (!dot & !dash)
+                k->dash_memory = 0;
+            else if (dash)                   // set dash memory
+                k->dash_memory = 1;
+        break;
+
+    // dash paddle pressed so set keyer_out high for time dependant on 3 x dot delay and weight
+    // also check if dot paddle is pressed during this time
+    case SENDDASH:
+        key_out(k, 1);
+        if (k->delay == k->dash_delay) {
+            k->delay = 0;
+            key_out(k, 0);
+            k->state = DASHDELAY;       // add inter-character spacing of one dot length
+        }
+        else k->delay++;
+
+        // if Mode A and both padles are relesed then clear dot memory
+        if (mode == KEYER_MODE_A)
+            if (!dot & !dash)
+                k->dot_memory = 0;
+            else if (dot)                    // set dot memory
+                k->dot_memory = 1;
+        break;
+
+    // add dot delay at end of the dot and check for dash memory, then check if paddle still held
+    case DOTDELAY:
+        if (k->delay == k->dot_delay) {
+            k->delay = 0;
+            if(!dot && mode == KEYER_STRAIGHT)   // just return if in bug mode
+                keyer_exit(k);
+            else if (k->dash_memory)                 // dash has been set during the dot so service
+                k->state = PREDASH;
+            else k->state = DOTHELD;             // dot is still active so service
+        }
+        else k->delay++;
+
+        if (dash)                                 // set dash memory
+            k->dash_memory = 1;
+        break;
+
+    // add dot delay at end of the dash and check for dot memory, then check if paddle still held
+    case DASHDELAY:
+        if (k->delay == k->dot_delay) {
+            k->delay = 0;
+
+            if (k->dot_memory)                       // dot has been set during the dash so service
+                k->state = PREDOT;
+            else k->state = DASHHELD;            // dash is still active so service
+        }
+        else k->delay++;
+
+        if (dot)                                  // set dot memory
+            k->dot_memory = 1;
+        break;
+
+    // check if dot paddle is still held, if so repeat the dot. Else check if Letter space is required
+    case DOTHELD:
+        if (dot)                                  // dot has been set during the dash so service
+            k->state = PREDOT;
+        else if (dash)                            // has dash paddle been pressed
+            k->state = PREDASH;
+        else if (k->spacing) {    // Letter space enabled so clear any pending dots or dashes
+            clear_memory(k);
+            k->state = LETTERSPACE;
+        }
+        else keyer_exit(k);
+        break;
+
+    // check if dash paddle is still held, if so repeat the dash. Else check if Letter space is required
+    case DASHHELD:
+        if (dash)                   // dash has been set during the dot so service
+            k->state = PREDASH;
+        else if (dot)               // has dot paddle been pressed
+            k->state = PREDOT;
+        else if (k->spacing) {    // Letter space enabled so clear any pending dots or dashes
+            clear_memory(k);
+            k->state = LETTERSPACE;
+        }
+        else keyer_exit(k);
+        break;
+
+    // Add letter space (3 x dot delay) to end of character and check if a paddle is pressed during this time.
+    // Actually add 2 x k->dot_delay since we already have a dot delay at the end of the character.
+    case LETTERSPACE:
+        if (k->delay == 2 * k->dot_delay) {
+            k->delay = 0;
+            if (k->dot_memory)         // check if a dot or dash paddle was pressed during the delay.
+                k->state = PREDOT;
+            else if (k->dash_memory)
+                k->state = PREDASH;
+            else keyer_exit(k);   // no memories set so restart
+        }
+        else k->delay++;
+
+        // save any key presses during the letter space delay
+        if (dot) k->dot_memory = 1;
+        if (dash) k->dash_memory = 1;
+        break;
+
+    // send an element of text, a mark of 0 is a word space on its own
+    case TEXTMARK:
+        if (k->breakin && (dot || dash)) {
+            text_flush(k);
+            k->delay = 0;
+            k->mark = -1;                   // cut short
+            key_out(k, 0);
+            k->state = CHECK;
+        }
+        else if (k->delay == k->text_mark) {
+            k->delay = 0;
+            key_out(k, 0);
+            k->state = TEXTSPACE;
+        }
+        else {
+            key_out(k, 1);
+            k->delay++;
+        }
+        break;
+
+    case TEXTSPACE:
+        if (k->breakin && (dot || dash)) {
+            text_flush(k);
+            k->delay = 0;
+            k->state = CHECK;
+        }
+        else if (k->delay == k->text_space) {
+            k->delay = 0;
+            k->state = CHECK;          // next element, or back to the paddles
+        }
+        else k->delay++;
+        break;
+
+    // PTT is up, wait out the lead then take the paddles as they were
+    case PTTLEAD:
+        if (k->delay == k->ptt_lead) {
+            k->delay = 0;
+            atomic_fetch_or_explicit(&k->pressed, k->lead_pressed, memory_order_relaxed);
+            k->state = CHECK;
+        }
+        else k->delay++;
+        break;
+
+    // PTT hangs on after the key comes up, in case it goes down again
+    case PTTTAIL:
+        if (keying(k)) {
+            k->delay = 0;
+            k->state = CHECK;
+        }
+        else if (k->delay == k->ptt_tail) {
+            k->delay = 0;
+            k->ptt_on = 0;
+            k->ptt(k->arg, 0);
+            k->state = EXITLOOP;
+        }
+        else k->delay++;
+        break;
+
+    default:
+        k->state = EXITLOOP;
+
+    }
+}
+
+#define KEYER_STEP(name, mode, reversed) \
+    static void name(keyer_t *k) { keyer_step(k, mode, reversed); }
+
+KEYER_STEP(step_straight, KEYER_STRAIGHT, 0)
+KEYER_STEP(step_straight_reversed, KEYER_STRAIGHT, 1)
+KEYER_STEP(step_mode_a, KEYER_MODE_A, 0)
+KEYER_STEP(step_mode_a_reversed, KEYER_MODE_A, 1)
+KEYER_STEP(step_mode_b, KEYER_MODE_B, 0)
+KEYER_STEP(step_mode_b_reversed, KEYER_MODE_B, 1)
+
+// a new mode is a case in keyer_step() and a row here
+static void (*const steps[][2])(keyer_t *k) = {
+    [KEYER_STRAIGHT] = { step_straight, step_straight_reversed },
+    [KEYER_MODE_A] = { step_mode_a, step_mode_a_reversed },
+    [KEYER_MODE_B] = { step_mode_b, step_mode_b_reversed },
+};
+
+// anything not straight or mode A has always been mode B
+static void select_step(keyer_t *k) {
+    int mode = (k->mode == KEYER_STRAIGHT || k->mode == KEYER_MODE_A) ? k->mode : KEYER_MODE_B;
+
+    k->step = steps[mode][k->reversed != 0];
+}
+
+// advance the state machine by one tick
+void keyer_tick(keyer_t *k) {
+    sample_paddles(k);
+    k->step(k);
+}
+
+// number of ticks left in a timed state before it has to make a decision,
+// 0 when the state acts immediately
+int keyer_hold(keyer_t *k) {
+    switch(k->state) {
+    case SENDDOT:
+    case DOTDELAY:
+    case DASHDELAY:
+        return k->dot_delay - k->delay;
+    case SENDDASH:
+        return k->dash_delay - k->delay;
+    case LETTERSPACE:
+        return 2 * k->dot_delay - k->delay;
+    case TEXTMARK:
+        return k->text_mark - k->delay;
+    case TEXTSPACE:
+        return k->text_space - k->delay;
+    case PTTLEAD:
+        return k->ptt_lead - k->delay;
+    case PTTTAIL:
+        return k->ptt_tail - k->delay;
+    default:
+        return 0;
+    }
+}
+
+// run the state machine for the next ticks ticks.  Untimed states take
+// no time, and whilst a timed state is counting, the paddles can't change
+// under us, so it skips straight to the end of the run and samples the
+// paddles once.  Whatever falls due at the end of the run is left for the
+// next call, which starts at that time.
+void keyer_run(keyer_t *k, int ticks) {
+    int hold, run;
+
+    while (k->state != EXITLOOP) {
+        hold = keyer_hold(k);
+        if (hold == 0) {
+            keyer_tick(k);
+            continue;
+        }
+        if (ticks == 0)
+            break;
+
+        run = (hold < ticks) ? hold : ticks;
+        k->delay += run - 1;
+        keyer_tick(k);
+        k->pos += run;
+        ticks -= run;
+        if (ticks == 0)
+            break;
+    }
+}
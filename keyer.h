@@ -0,0 +1,149 @@
+/*
+
+    iambic keyer state machine, see keyer.c
+
+*/
+
+#ifndef KEYER_H
+#define KEYER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define KEYER_STRAIGHT 0
+#define KEYER_MODE_A 1
+#define KEYER_MODE_B 2
+
+#define TEXT_QUEUE_SIZE 256     /* must be a power of two */
+
+/*
+** a stored message, compiled ahead into elements in dots so it follows
+** the speed and weight without being compiled again.
+*/
+#define KEYER_ELEMENT_END 0
+#define KEYER_ELEMENT_DOT 1
+#define KEYER_ELEMENT_DASH 2
+#define KEYER_ELEMENT_SPACE 3   /* no mark, just the space */
+#define KEYER_ELEMENT_SERIAL 4  /* the message's serial elements go here */
+
+typedef struct {
+    unsigned char mark;         /* KEYER_ELEMENT_ */
+    unsigned char space;        /* dots of key up after it */
+} keyer_element_t;
+
+typedef struct {
+    const keyer_element_t *text;
+    const keyer_element_t *serial;      /* the number as it is sent this time, NULL if none */
+} keyer_message_t;
+
+typedef struct keyer {
+    /* settings, call keyer_update() after changing them */
+    int speed;
+    int weight;
+    int reversed;
+    int mode;
+    int spacing;
+    int breakin;                /* a paddle aborts queued text */
+
+    /* ticks run since the driver last zeroed it, for timestamping output */
+    unsigned pos;
+
+    /* the rest belongs to keyer.c */
+    int state;
+    int delay;
+    int dot_memory, dash_memory;
+    unsigned tick_rate;         /* ticks per second */
+    int exact;                  /* 0 for the original 1 ms arithmetic */
+    int dot_delay, dash_delay;
+    /*
+    ** the paddles, written by keyer_paddle() from any thread.  the levels,
+    ** and every closure since the last tick, so a tap that opens again
+    ** before the keyer looks is still seen.  bit 0 is the left paddle.
+    */
+    atomic_int paddles, pressed;
+    int paddle[2];              /* as sampled for this tick */
+    void (*step)(struct keyer *k);      /* a tick for the mode and paddle order */
+    void (*output)(void *arg, int state);
+    void (*boundary)(void *arg);
+    void (*ptt)(void *arg, int state);
+    void *arg;
+    int key;                    /* as last output */
+    int mark;                   /* ticks the key down being output lasts, 0 if not known */
+    int ptt_lead_us, ptt_tail_us;
+    int ptt_lead, ptt_tail;     /* in ticks */
+    int ptt_on;
+    int lead_pressed;           /* closures seen before the PTT lead, replayed after it */
+
+    /*
+    ** text elements waiting to be sent, in microseconds.  single producer,
+    ** the text reader, and single consumer, whichever engine runs the keyer.
+    */
+    struct { int mark, space; } text_queue[TEXT_QUEUE_SIZE];
+    atomic_uint text_head, text_tail;
+    int text_mark, text_space;  /* the element being sent, in ticks */
+
+    /* a message, handed over whole by keyer_send() and sent ahead of the text */
+    _Atomic(const keyer_message_t *) message_req, message;
+    const keyer_element_t *message_at, *message_resume;
+} keyer_t;
+
+void keyer_init(keyer_t *k, void (*output)(void *arg, int state), void *arg);
+/* called between elements, where the settings can change */
+void keyer_set_boundary(keyer_t *k, void (*boundary)(void *arg));
+void keyer_set_ptt(keyer_t *k, void (*ptt)(void *arg, int state), int lead_us, int tail_us);
+void keyer_set_clock(keyer_t *k, unsigned tick_rate, int exact);
+unsigned keyer_get_tick_rate(keyer_t *k);
+int keyer_dot_ticks(keyer_t *k);
+int keyer_dash_ticks(keyer_t *k);
+/*
+** in the output function, for a key down the ticks until it comes up, 0
+** for a straight key, and for a key up -1 if it came early
+*/
+int keyer_mark(keyer_t *k);
+void keyer_update(keyer_t *k);
+
+void keyer_paddle(keyer_t *k, int right, int state);
+int keyer_idle(keyer_t *k);
+void keyer_start(keyer_t *k);
+
+/* queue a text element, returns -1 if the queue is full */
+int keyer_text_push(keyer_t *k, int mark_us, int space_us);
+/*
+** send a message from its next element boundary, instead of any it is
+** sending, from any one thread.  m is read until keyer_sending() says
+** otherwise.
+*/
+void keyer_send(keyer_t *k, const keyer_message_t *m);
+int keyer_sending(keyer_t *k, const keyer_message_t *m);
+
+/*
+** paddle debounce, for the GPIO callback and replay alike.  an edge
+** within make_us of the paddle closing, or break_us of it opening, is
+** held back.  the last level seen is kept, and if it still differs from
+** the keyer's when the hold-off ends, that is when it is applied, so a
+** tap shorter than the hold-off can't leave the paddle closed.
+*/
+typedef struct {
+    int state;                  /* the level the keyer has */
+    uint32_t tick;              /* and when it changed, us */
+    int raw;                    /* the level last seen, held back or not */
+    uint32_t raw_tick;
+} keyer_debounce_t;
+
+/*
+** an edge at tick.  returns 1 if the keyer takes it, 0 if it changes
+** nothing, or -1 if it is held back, and then keyer_debounce_settle()
+** wants calling *wait us from tick.
+*/
+int keyer_debounce_edge(keyer_debounce_t *d, int state, uint32_t tick,
+                        uint32_t make_us, uint32_t break_us, uint32_t *wait);
+/* the same at the end of a hold-off, 1 if the held back level was applied */
+int keyer_debounce_settle(keyer_debounce_t *d, uint32_t now,
+                          uint32_t make_us, uint32_t break_us, uint32_t *wait);
+
+void keyer_tick(keyer_t *k);
+int keyer_hold(keyer_t *k);
+int keyer_polling(keyer_t *k);
+void keyer_run(keyer_t *k, int ticks);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+
+    keyer instrumentation, see keyer_stats.h
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "keyer_stats.h"
+
+static keyer_stats_t local_stats;
+keyer_stats_t *keyer_stats = &local_stats;
+
+static void latency_init(latency_hist_t *h) {
+    atomic_init(&h->min, ~0u);
+}
+
+/*
+** map the stats into shared memory if we can, otherwise they
+** just live in the process.
+*/
+void keyer_stats_init() {
+    keyer_stats_t *s = MAP_FAILED;
+    int fd = shm_open(KEYER_STATS_SHM, O_CREAT | O_RDWR, 0644);
+
+    if (fd >= 0) {
+        if (ftruncate(fd, sizeof(keyer_stats_t)) == 0)
+            s = mmap(NULL, sizeof(keyer_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (s == MAP_FAILED)
+        fprintf(stderr, "stats: no shared memory segment %s, SIGUSR1 only\n", KEYER_STATS_SHM);
+    else {
+        memset(s, 0, sizeof(*s));
+        keyer_stats = s;
+    }
+
+    keyer_stats->magic = KEYER_STATS_MAGIC;
+    keyer_stats->version = KEYER_STATS_VERSION;
+    latency_init(&keyer_stats->paddle_to_gpio);
+    latency_init(&keyer_stats->gpio_to_tone);
+    latency_init(&keyer_stats->paddle_to_tone);
+    latency_init(&keyer_stats->render_ns);
+    atomic_init(&keyer_stats->pending_us, -1);
+}
+
+/* safe from any thread, a handful of relaxed atomics and no syscalls */
+void latency_record(latency_hist_t *h, unsigned usecs) {
+    unsigned v, bin = (usecs == 0) ? 0 : 32 - __builtin_clz(usecs);
+
+    if (bin >= LATENCY_BINS)
+        bin = LATENCY_BINS-1;
+    atomic_fetch_add_explicit(&h->bins[bin], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, usecs, memory_order_relaxed);
+
+    v = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (usecs < v && ! atomic_compare_exchange_weak_explicit(&h->min, &v, usecs,
+                                                                memory_order_relaxed, memory_order_relaxed))
+        ;
+    stats_max(&h->max, usecs);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_release);
+}
+
+void stats_max(atomic_uint *max, unsigned v) {
+    unsigned m = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (v > m && ! atomic_compare_exchange_weak_explicit(max, &m, v,
+                                                            memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void latency_dump(FILE *f, const char *name, latency_hist_t *h, const char *unit) {
+    unsigned count = atomic_load(&h->count);
+    unsigned n;
+    int k;
+
+    if (count == 0) {
+        fprintf(f, "%-15s n 0\n", name);
+        return;
+    }
+    fprintf(f, "%-15s n %u min %u avg %.1f max %u %s\n", name, count,
+            atomic_load(&h->min), (double)atomic_load(&h->sum) / count, atomic_load(&h->max), unit);
+    for (k = 0; k < LATENCY_BINS; k++)
+        if ((n = atomic_load(&h->bins[k])) != 0) {
+            if (k == LATENCY_BINS-1)
+                fprintf(f, "    >=%u%s %u\n", 1u << (k-1), unit, n);
+            else
+                fprintf(f, "    <%u%s %u\n", 1u << k, unit, n);
+        }
+}
+
+void keyer_stats_dump(FILE *f) {
+    unsigned long long frames;
+    unsigned rate;
+
+    latency_dump(f, "paddle_to_gpio", &keyer_stats->paddle_to_gpio, "us");
+    latency_dump(f, "gpio_to_tone", &keyer_stats->gpio_to_tone, "us");
+    latency_dump(f, "paddle_to_tone", &keyer_stats->paddle_to_tone, "us");
+    fprintf(f, "%-15s make %u break %u edges dropped\n", "debounce",
+            atomic_load(&keyer_stats->bounce_make), atomic_load(&keyer_stats->bounce_break));
+    fprintf(f, "%-15s %u key transitions lost\n", "key_overflows", atomic_load(&keyer_stats->key_overflows));
+    if (atomic_load(&keyer_stats->midi_dropped))
+        fprintf(f, "%-15s %u notes dropped\n", "midi", atomic_load(&keyer_stats->midi_dropped));
+    rate = atomic_load(&keyer_stats->audio_rate);
+    frames = atomic_load(&keyer_stats->audio_frames);
+    if (frames) {
+        latency_dump(f, "render", &keyer_stats->render_ns, "ns");
+        fprintf(f, "%-15s period %u frames, %u xruns, dsp load %.2f%% max %.2f%%, %u restarts\n", "audio",
+                atomic_load(&keyer_stats->audio_period), atomic_load(&keyer_stats->xruns),
+                atomic_load(&keyer_stats->dsp_load) / 100.0, atomic_load(&keyer_stats->dsp_load_max) / 100.0,
+                atomic_load(&keyer_stats->audio_restarts));
+    }
+    if (rate && frames)
+        fprintf(f, "%-15s %.1f s of %.1f s audio (%.0f%%)\n", "idle",
+                (double)atomic_load(&keyer_stats->idle_frames) / rate, (double)frames / rate,
+                100.0 * atomic_load(&keyer_stats->idle_frames) / frames);
+    if (atomic_load(&keyer_stats->remote_edges) || atomic_load(&keyer_stats->remote_lost))
+        fprintf(f, "%-15s %u edges played, %u lost, %u late, %.1f ms deep\n", "remote",
+                atomic_load(&keyer_stats->remote_edges), atomic_load(&keyer_stats->remote_lost),
+                atomic_load(&keyer_stats->remote_late), atomic_load(&keyer_stats->remote_depth_us) / 1000.0);
+    fflush(f);
+}
@@ -0,0 +1,64 @@
+/*
+
+    keyer instrumentation: lock-free counters and latency histograms,
+    kept in a shared memory segment so they can be watched from outside
+    the process, and dumped to stdout on SIGUSR1.
+
+*/
+
+#ifndef KEYER_STATS_H
+#define KEYER_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define KEYER_STATS_SHM "/iambic-keyer"
+#define KEYER_STATS_MAGIC 0x6b657972	/* "keyr" */
+#define KEYER_STATS_VERSION 7
+
+/*
+** bin 0 counts deltas of 0 us, bin k counts deltas in [2^(k-1), 2^k) us,
+** and the last bin everything longer.
+*/
+#define LATENCY_BINS 24
+
+typedef struct {
+    atomic_uint count;
+    atomic_uint min, max;	/* us */
+    atomic_ullong sum;		/* us */
+    atomic_uint bins[LATENCY_BINS];
+} latency_hist_t;
+
+typedef struct {
+    uint32_t magic, version;
+    latency_hist_t paddle_to_gpio;	/* keyer_event() tick to gpioWrite() in set_keyer_out() */
+    latency_hist_t gpio_to_tone;	/* set_keyer_out() to the rise leaving process(), its period behind included */
+    latency_hist_t paddle_to_tone;	/* both of the above, for elements started by a paddle */
+    atomic_int pending_us;		/* paddle_to_gpio of the key down process() hasn't seen yet, or -1 */
+    atomic_uint bounce_make;		/* paddle edges dropped within the hold-off after a make */
+    atomic_uint bounce_break;		/* and after a break */
+    atomic_uint key_overflows;		/* key transitions lost to a full sidetone event queue */
+    atomic_ullong audio_frames;		/* rendered by the sidetone */
+    atomic_ullong idle_frames;		/* of them, zeroed by the idle fast path */
+    atomic_uint audio_rate;		/* frames per second */
+    atomic_uint remote_edges;		/* played from the network */
+    atomic_uint remote_lost;		/* never arrived, the levels put them right */
+    atomic_uint remote_late;		/* arrived after they were due */
+    atomic_uint remote_depth_us;	/* the jitter buffer now */
+    latency_hist_t render_ns;		/* a sidetone cycle, the whole callback, in ns */
+    atomic_uint xruns;			/* JACK's, or ALSA underruns recovered from */
+    atomic_uint dsp_load, dsp_load_max;	/* % of the period in hundredths, JACK's for the graph, ALSA's our own */
+    atomic_uint audio_period;		/* frames */
+    atomic_uint audio_restarts;		/* JACK servers reconnected to */
+    atomic_uint midi_dropped;		/* MIDI key notes JACK wouldn't take */
+} keyer_stats_t;
+
+extern keyer_stats_t *keyer_stats;
+
+void keyer_stats_init();
+void latency_record(latency_hist_t *h, unsigned usecs);
+void stats_max(atomic_uint *max, unsigned v);
+void keyer_stats_dump(FILE *f);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+
+    contest message memories, see memory.h
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "memory.h"
+#include "morse.h"
+
+#define SERIAL_DIGITS 3		/* at least, with leading zeros */
+#define SERIAL_MAX 999999999	/* to start from, ten digits are the most it can send */
+#define SERIAL_MAX_ELEMENTS (10 * 5 + 1)
+
+static struct {
+    keyer_element_t element[MEMORY_MAX_ELEMENTS];
+    int serial;			/* has a # */
+} memories[MEMORY_MAX];
+
+/*
+** what a send hands the keyer.  three, so one is always free of the one
+** being sent and the one handed over but not yet taken.
+*/
+static struct {
+    keyer_message_t message;
+    keyer_element_t serial[SERIAL_MAX_ELEMENTS];
+} sends[3];
+
+static int next_serial = 1;
+
+/* the elements of a string, each letter ending in a letter space and each blank a word space */
+static int compile(keyer_element_t *e, int max, const char *text, int serial_ok, int *serial) {
+    const char *code;
+    int n = 0, i;
+
+    for (; *text; text++) {
+        if (*text == '#' && serial_ok) {
+            if (n == max)
+                return -1;
+            e[n].mark = KEYER_ELEMENT_SERIAL;
+            e[n++].space = 0;
+            *serial = 1;
+            continue;
+        }
+        if (*text == ' ' || *text == '\t' || *text == '\n') {
+            // the previous letter's space is already 3 of the 7
+            if (n == max)
+                return -1;
+            e[n].mark = KEYER_ELEMENT_SPACE;
+            e[n++].space = 4;
+            continue;
+        }
+        code = morse_code(*text);
+        if (code == NULL)
+            continue;
+        if (n + (int)strlen(code) > max)
+            return -1;
+        for (i = 0; code[i]; i++) {
+            e[n].mark = (code[i] == '.') ? KEYER_ELEMENT_DOT : KEYER_ELEMENT_DASH;
+            e[n++].space = 1;
+        }
+        e[n-1].space = 3;
+    }
+    if (n == max)
+        return -1;
+    e[n].mark = KEYER_ELEMENT_END;
+    e[n].space = 0;
+    return n;
+}
+
+int memory_store(int n, const char *text) {
+    int serial = 0;
+
+    if (n < 0 || n >= MEMORY_MAX)
+        return -1;
+    if (compile(memories[n].element, MEMORY_MAX_ELEMENTS, text, 1, &serial) < 0) {
+        memories[n].element[0].mark = KEYER_ELEMENT_END;
+        return -1;
+    }
+    memories[n].serial = serial;
+    return 0;
+}
+
+int memory_set_serial(int serial) {
+    if (serial < 0 || serial > SERIAL_MAX)
+        return -1;
+    next_serial = serial;
+    return 0;
+}
+
+void memory_send(keyer_t *k, int n) {
+    char digits[16];
+    int i;
+
+    if (n < 0 || n >= MEMORY_MAX || memories[n].element[0].mark == KEYER_ELEMENT_END)
+        return;
+    for (i = 0; keyer_sending(k, &sends[i].message); i++)
+        ;
+    sends[i].message.text = memories[n].element;
+    sends[i].message.serial = NULL;
+    // a number that doesn't fit is left out, not sent unterminated
+    if (memories[n].serial) {
+        snprintf(digits, sizeof(digits), "%0*d", SERIAL_DIGITS, next_serial);
+        if (next_serial < INT_MAX)
+            next_serial++;
+        if (compile(sends[i].serial, SERIAL_MAX_ELEMENTS, digits, 0, NULL) >= 0)
+            sends[i].message.serial = sends[i].serial;
+    }
+    keyer_send(k, &sends[i].message);
+}
@@ -0,0 +1,25 @@
+/*
+
+    contest message memories.  each is compiled into keyer elements
+    when it is stored, so sending one is handing the keyer a pointer.
+    a # in a message is the serial number, the only part encoded when
+    it is sent, and which goes up by one each time it is.
+
+*/
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "keyer.h"
+
+#define MEMORY_MAX 8
+#define MEMORY_MAX_ELEMENTS 512
+
+/* compile a message into memory n, returns -1 if it doesn't fit */
+int memory_store(int n, const char *text);
+/* the number the next # sends, 1 to start with, -1 if it is out of range */
+int memory_set_serial(int serial);
+/* send memory n on k, from the one thread that sends them */
+void memory_send(keyer_t *k, int n);
+
+#endif
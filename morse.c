@@ -0,0 +1,74 @@
+/*
+
+    morse code table, see morse.h
+
+*/
+
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+#include "morse.h"
+
+static const char *morse_codes[128] = {
+    ['A'] = ".-",     ['B'] = "-...",   ['C'] = "-.-.",   ['D'] = "-..",
+    ['E'] = ".",      ['F'] = "..-.",   ['G'] = "--.",    ['H'] = "....",
+    ['I'] = "..",     ['J'] = ".---",   ['K'] = "-.-",    ['L'] = ".-..",
+    ['M'] = "--",     ['N'] = "-.",     ['O'] = "---",    ['P'] = ".--.",
+    ['Q'] = "--.-",   ['R'] = ".-.",    ['S'] = "...",    ['T'] = "-",
+    ['U'] = "..-",    ['V'] = "...-",   ['W'] = ".--",    ['X'] = "-..-",
+    ['Y'] = "-.--",   ['Z'] = "--..",
+    ['0'] = "-----",  ['1'] = ".----",  ['2'] = "..---",  ['3'] = "...--",
+    ['4'] = "....-",  ['5'] = ".....",  ['6'] = "-....",  ['7'] = "--...",
+    ['8'] = "---..",  ['9'] = "----.",
+    ['.'] = ".-.-.-", [','] = "--..--", ['?'] = "..--..", ['/'] = "-..-.",
+    ['='] = "-...-",  ['+'] = ".-.-.",  ['-'] = "-....-", ['\''] = ".----.",
+    ['"'] = ".-..-.", ['('] = "-.--.",  [')'] = "-.--.-", [':'] = "---...",
+    [';'] = "-.-.-.", ['@'] = ".--.-.", ['!'] = "-.-.--", ['&'] = ".-...",
+    ['_'] = "..--.-", ['$'] = "...-..-",
+};
+
+static morse_char_t morse_table[128];
+static morse_char_t word_space;
+
+/*
+** dot = 1200 / WPM ms, a dash is 3 dots at the standard weight of 50,
+** element space 1 dot, letter space 3 and word space 7.
+*/
+void morse_update(int speed, int weight) {
+    double dot = 1200000.0 / speed;
+    int c, i;
+
+    for (c = 0; c < 128; c++) {
+        const char *code = morse_codes[c];
+        morse_char_t *m = &morse_table[c];
+
+        memset(m, 0, sizeof(*m));
+        if (code == NULL)
+            continue;
+        for (i = 0; code[i]; i++) {
+            m->mark[i] = lround(code[i] == '.' ? dot : dot * 3 * weight / 50);
+            m->space[i] = lround(dot);
+        }
+        m->n = i;
+        m->space[i-1] = lround(3 * dot);
+    }
+
+    // the previous character's letter space is already 3 of the 7
+    word_space.n = 1;
+    word_space.mark[0] = 0;
+    word_space.space[0] = lround(4 * dot);
+}
+
+const char *morse_code(int c) {
+    if (c < 0 || c >= 128)
+        return NULL;
+    return morse_codes[toupper(c)];
+}
+
+const morse_char_t *morse_lookup(int c) {
+    if (c == ' ' || c == '\n' || c == '\t')
+        return &word_space;
+    if (c < 0 || c >= 128)
+        return &morse_table[0];
+    return &morse_table[toupper(c)];
+}
@@ -0,0 +1,24 @@
+/*
+
+    morse code table, precompiled into element lengths for the
+    current speed and weight
+
+*/
+
+#ifndef MORSE_H
+#define MORSE_H
+
+#define MORSE_MAX_ELEMENTS 8
+
+typedef struct {
+    int n;				/* elements in the character, 0 if it has no code */
+    int mark[MORSE_MAX_ELEMENTS];	/* key down lengths in us */
+    int space[MORSE_MAX_ELEMENTS];	/* key up lengths in us, the last includes the letter space */
+} morse_char_t;
+
+void morse_update(int speed, int weight);
+const morse_char_t *morse_lookup(int c);
+/* the dots and dashes of a character, e.g. ".-" for A, NULL if it has no code */
+const char *morse_code(int c);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+
+    remote keying over UDP, see remote.h
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include "remote.h"
+#include "keyer_stats.h"
+
+#define REMOTE_VERSION 1
+#define REMOTE_BATCH 16			/* edges in every datagram, the newest */
+#define REMOTE_QUEUE 256		/* must be a power of two */
+#define REMOTE_HEADER 13
+#define REMOTE_EDGE 5
+#define REMOTE_REPEAT_MS 5		/* the last datagram again after this, */
+#define REMOTE_REPEATS 3		/* this many times, in case it was lost */
+#define REMOTE_HEARTBEAT_MS 250		/* and then at this interval */
+#define REMOTE_TIMEOUT_MS 1000		/* with nothing heard, everything opens */
+#define REMOTE_MAX_DEPTH_MS 250
+#define REMOTE_LATE_US 1000		/* edges played later than this are counted */
+#define REMOTE_SETTLE_MS 250		/* quiet for this long, the depth can change */
+
+#define FLAG_RIGHT 0x08
+#define FLAG_CLOSED 0x10
+#define FLAG_KEY 0x20
+
+static int remote_running;
+
+static uint64_t now_us() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000ull + t.tv_nsec / 1000;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int level_bit(uint8_t flags) {
+    return 1 << (2 * (flags & 3) + ((flags & FLAG_RIGHT) != 0));
+}
+
+/*
+** the sending side.  remote_send() is called from the GPIO callback or
+** the keyer engine, so it only fills a single producer queue and posts
+** the sender thread, which does the batching and the system calls.
+*/
+typedef struct {
+    uint32_t tick;
+    uint8_t flags;
+} remote_event_t;
+
+static int send_fd = -1;
+static pthread_t send_thread_id;
+static uint32_t (*send_clock)(void);
+static remote_event_t queue[REMOTE_QUEUE];
+static atomic_uint queue_head, queue_tail;
+static sem_t send_wake;
+
+void remote_send(int id, int what, int right, int state, uint32_t tick) {
+    unsigned head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    remote_event_t *e;
+
+    if (send_fd < 0)
+        return;
+    if (head - atomic_load_explicit(&queue_tail, memory_order_acquire) == REMOTE_QUEUE)
+        return;			/* the levels in the next datagram put it right */
+    e = &queue[head & (REMOTE_QUEUE-1)];
+    e->tick = tick;
+    e->flags = (id & 3) | (right ? FLAG_RIGHT : 0) | (state ? FLAG_CLOSED : 0) |
+               (what == REMOTE_KEY ? FLAG_KEY : 0);
+    atomic_store_explicit(&queue_head, head+1, memory_order_release);
+    sem_post(&send_wake);
+}
+
+static void send_batch(const remote_event_t *history, uint32_t seq, uint8_t levels) {
+    uint8_t buf[REMOTE_HEADER + REMOTE_BATCH * REMOTE_EDGE], *p = buf + REMOTE_HEADER;
+    int n = (seq < REMOTE_BATCH) ? seq : REMOTE_BATCH, k;
+    uint32_t first = seq - n;
+
+    buf[0] = 'K';
+    buf[1] = 'R';
+    buf[2] = REMOTE_VERSION;
+    buf[3] = n;
+    put32(buf + 4, first);
+    put32(buf + 8, send_clock());
+    buf[12] = levels;
+    for (k = 0; k < n; k++, p += REMOTE_EDGE) {
+        const remote_event_t *e = &history[(first + k) % REMOTE_BATCH];
+        put32(p, e->tick);
+        p[4] = e->flags;
+    }
+    send(send_fd, buf, p - buf, 0);
+}
+
+static void* send_thread(void *arg) {
+    remote_event_t history[REMOTE_BATCH];
+    struct timespec wait;
+    uint32_t seq = 0;		/* of the next edge */
+    uint8_t levels = 0;
+    unsigned tail, head;
+    int fresh, repeats = 0;
+
+    while (remote_running) {
+        clock_gettime(CLOCK_MONOTONIC, &wait);
+        wait.tv_nsec += (repeats ? REMOTE_REPEAT_MS : REMOTE_HEARTBEAT_MS) * 1000000l;
+        while (wait.tv_nsec >= 1000000000l) {
+            wait.tv_nsec -= 1000000000l;
+            wait.tv_sec++;
+        }
+        if (sem_clockwait(&send_wake, CLOCK_MONOTONIC, &wait) < 0 && repeats)
+            repeats--;
+        while (sem_trywait(&send_wake) == 0)
+            ;
+
+        fresh = 0;
+        tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+        head = atomic_load_explicit(&queue_head, memory_order_acquire);
+        while (tail != head) {
+            remote_event_t *e = &queue[tail++ & (REMOTE_QUEUE-1)];
+            history[seq++ % REMOTE_BATCH] = *e;
+            if (e->flags & FLAG_CLOSED)
+                levels |= level_bit(e->flags);
+            else
+                levels &= ~level_bit(e->flags);
+            if (++fresh == REMOTE_BATCH) {
+                send_batch(history, seq, levels);
+                fresh = 0;
+            }
+        }
+        atomic_store_explicit(&queue_tail, tail, memory_order_release);
+        if (fresh)
+            repeats = REMOTE_REPEATS;
+        send_batch(history, seq, levels);	/* new edges, a repeat or a heartbeat */
+    }
+    return NULL;
+}
+
+int remote_send_start(const char *host, int port, uint32_t (*clock)(void)) {
+    struct addrinfo hints, *ai;
+    char service[16];
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if ((err = getaddrinfo(host, service, &hints, &ai)) != 0) {
+        fprintf(stderr, "remote: %s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    send_fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+    if (send_fd < 0 || connect(send_fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("remote socket");
+        freeaddrinfo(ai);
+        return -1;
+    }
+    freeaddrinfo(ai);
+
+    send_clock = clock;
+    sem_init(&send_wake, 0, 0);
+    remote_running = 1;
+    if (pthread_create(&send_thread_id, NULL, send_thread, NULL)) {
+        fprintf(stderr, "pthread_create for send_thread failed\n");
+        close(send_fd);
+        send_fd = -1;
+        return -1;
+    }
+    printf("remote: sending to %s port %d\n", host, port);
+    return 0;
+}
+
+/*
+** the receiving side.  one thread reads the datagrams and plays the edges
+** out, each at its sender tick plus play, the sender to local clock offset
+** plus the jitter buffer's depth.  the offset floor is the quickest
+** transit seen, creeping up slowly so it follows the drift between the
+** two clocks, and the depth three times the mean transit above it.  play
+** only moves with nothing buffered, everything open and nothing played
+** for REMOTE_SETTLE_MS, between words or slow letters, so the edges of
+** a character all keep their spacing.
+*/
+static int listen_fd = -1;
+static pthread_t listen_thread_id;
+static remote_edge_t listen_edge;
+static void *listen_arg;
+static int64_t min_depth;		/* us */
+
+static struct {
+    struct { uint64_t tick; uint8_t flags; } pending[REMOTE_QUEUE];
+    unsigned head, tail;
+    int synced;
+    uint32_t want;		/* sequence number of the next edge */
+    uint64_t sender;		/* the sender's clock as last heard, unwrapped */
+    int64_t floor, jitter, play;	/* us */
+    uint64_t heard;		/* local time it was last heard */
+    uint64_t played;		/* and an edge was last played */
+    uint8_t down;		/* levels as played */
+    int key;			/* FLAG_KEY if the edges were key edges */
+} rx;
+
+static void play_edge(uint8_t flags) {
+    int state = (flags & FLAG_CLOSED) != 0;
+
+    if (state)
+        rx.down |= level_bit(flags);
+    else
+        rx.down &= ~level_bit(flags);
+    rx.key = flags & FLAG_KEY;
+    rx.played = now_us();
+    atomic_fetch_add_explicit(&keyer_stats->remote_edges, 1, memory_order_relaxed);
+    listen_edge(flags & 3, (flags & FLAG_KEY) ? REMOTE_KEY : REMOTE_PADDLE,
+                (flags & FLAG_RIGHT) != 0, state, listen_arg);
+}
+
+/* open or close whatever differs from levels */
+static void play_levels(uint8_t levels) {
+    int bit;
+
+    for (bit = 0; bit < 8; bit++)
+        if ((rx.down ^ levels) & (1 << bit))
+            play_edge((bit >> 1) | ((bit & 1) ? FLAG_RIGHT : 0) |
+                      ((levels & (1 << bit)) ? FLAG_CLOSED : 0) | rx.key);
+}
+
+static void receive(const uint8_t *buf, int n, uint64_t local) {
+    uint32_t first, clock, seq;
+    uint64_t sender;
+    int64_t transit, depth;
+    int count, k;
+
+    if (n < REMOTE_HEADER || buf[0] != 'K' || buf[1] != 'R' || buf[2] != REMOTE_VERSION)
+        return;
+    count = buf[3];
+    if (n != REMOTE_HEADER + count * REMOTE_EDGE)
+        return;
+    first = get32(buf + 4);
+    clock = get32(buf + 8);
+
+    if (!rx.synced) {
+        rx.sender = clock;
+        rx.floor = local - clock;
+        rx.jitter = 0;
+        rx.play = rx.floor + min_depth;
+        rx.want = first + count;	/* what came before, the levels stand for */
+        rx.synced = 1;
+    }
+    sender = rx.sender + (int32_t)(clock - (uint32_t)rx.sender);
+    if (sender > rx.sender)
+        rx.sender = sender;
+    rx.heard = local;
+
+    transit = local - sender;
+    if (transit < rx.floor)
+        rx.floor = transit;
+    else
+        rx.floor += (transit - rx.floor) >> 8;
+    rx.jitter += (transit - rx.floor - rx.jitter) / 16;
+    depth = 3 * rx.jitter;
+    if (depth < min_depth) depth = min_depth;
+    if (depth > REMOTE_MAX_DEPTH_MS * 1000) depth = REMOTE_MAX_DEPTH_MS * 1000;
+    if (rx.head == rx.tail && rx.down == 0 && local - rx.played > REMOTE_SETTLE_MS * 1000) {
+        rx.play = rx.floor + depth;
+        atomic_store_explicit(&keyer_stats->remote_depth_us, depth, memory_order_relaxed);
+    }
+
+    for (k = 0; k < count; k++) {
+        const uint8_t *p = buf + REMOTE_HEADER + k * REMOTE_EDGE;
+
+        seq = first + k;
+        if ((int32_t)(seq - rx.want) < 0)
+            continue;		/* had it already */
+        if (seq != rx.want)
+            atomic_fetch_add_explicit(&keyer_stats->remote_lost, seq - rx.want, memory_order_relaxed);
+        rx.want = seq + 1;
+        if (rx.head - rx.tail == REMOTE_QUEUE) {
+            atomic_fetch_add_explicit(&keyer_stats->remote_lost, 1, memory_order_relaxed);
+            continue;
+        }
+        rx.pending[rx.head & (REMOTE_QUEUE-1)].tick = sender + (int32_t)(get32(p) - clock);
+        rx.pending[rx.head & (REMOTE_QUEUE-1)].flags = p[4];
+        rx.head++;
+    }
+
+    /* up to date and nothing to play, so the levels are what should be down now */
+    if (first + count == rx.want && rx.head == rx.tail)
+        play_levels(buf[12]);
+}
+
+static void* listen_thread(void *arg) {
+    uint8_t buf[REMOTE_HEADER + 255 * REMOTE_EDGE];
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    struct timespec timeout;
+    uint64_t now, due, wait;
+    int n;
+
+    while (remote_running) {
+        now = now_us();
+        wait = REMOTE_HEARTBEAT_MS * 1000;
+        while (rx.head != rx.tail) {
+            due = rx.pending[rx.tail & (REMOTE_QUEUE-1)].tick + rx.play;
+            if (due > now) {
+                wait = due - now;
+                break;
+            }
+            if (now - due > REMOTE_LATE_US) {
+                atomic_fetch_add_explicit(&keyer_stats->remote_late, 1, memory_order_relaxed);
+                rx.jitter += (now - due) / 3;	/* deep enough for it next time */
+            }
+            play_edge(rx.pending[rx.tail++ & (REMOTE_QUEUE-1)].flags);
+        }
+
+        if (rx.synced && rx.head == rx.tail && now - rx.heard > REMOTE_TIMEOUT_MS * 1000) {
+            fprintf(stderr, "remote: nothing heard for %d ms\n", REMOTE_TIMEOUT_MS);
+            play_levels(0);
+            rx.synced = 0;
+        }
+
+        timeout.tv_sec = wait / 1000000;
+        timeout.tv_nsec = wait % 1000000 * 1000;
+        if (ppoll(&pfd, 1, &timeout, NULL) <= 0)
+            continue;
+        while ((n = recv(listen_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            receive(buf, n, now_us());
+    }
+    return NULL;
+}
+
+int remote_listen_start(int port, int min_ms, remote_edge_t edge, void *arg) {
+    struct sockaddr_in addr;
+
+    listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listen_fd < 0) {
+        perror("remote socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("remote bind");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    listen_edge = edge;
+    listen_arg = arg;
+    min_depth = min_ms * 1000;
+    remote_running = 1;
+    if (pthread_create(&listen_thread_id, NULL, listen_thread, NULL)) {
+        fprintf(stderr, "pthread_create for listen_thread failed\n");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    printf("remote: listening on udp port %d, at least %d ms behind\n", port, min_ms);
+    return 0;
+}
+
+void remote_close() {
+    if (!remote_running)
+        return;
+    remote_running = 0;
+    if (send_fd >= 0) {
+        sem_post(&send_wake);
+        pthread_join(send_thread_id, NULL);
+        close(send_fd);
+        send_fd = -1;
+    }
+    if (listen_fd >= 0) {
+        pthread_join(listen_thread_id, NULL);
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
@@ -0,0 +1,41 @@
+/*
+
+    remote keying over UDP.  the sender stamps each paddle or key edge
+    with the microsecond clock it was seen on and batches them into
+    datagrams, each carrying the last REMOTE_BATCH edges so a lost one
+    is filled in by the next.  the receiver plays them out a jitter
+    buffer's depth behind the sender's clock, so the edges keep the
+    spacing they were sent with, and the depth follows the network.
+
+    a datagram, all fields in network order:
+
+        "KR", version, edge count
+        uint32 sequence number of the first edge
+        uint32 sender clock when it was sent, us
+        uint8 levels of every input as of the last edge, bit 2*id+right
+        then per edge uint32 tick, us, and uint8 flags:
+        bits 0-1 keyer id, bit 3 right paddle, bit 4 closed, bit 5 key edge
+
+*/
+
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <stdint.h>
+
+#define REMOTE_PADDLE 0		/* edges from keyer_event(), for the far keyer to send */
+#define REMOTE_KEY 1		/* keyed output from set_keyer_out(), sent as a straight key */
+
+typedef void (*remote_edge_t)(int id, int what, int right, int state, void *arg);
+
+/* send edges to host:port, clock is the one their ticks are on */
+int remote_send_start(const char *host, int port, uint32_t (*clock)(void));
+/* queue an edge, from the one thread that sees them, never blocks */
+void remote_send(int id, int what, int right, int state, uint32_t tick);
+
+/* play edges from port into edge, at least min_ms behind the sender */
+int remote_listen_start(int port, int min_ms, remote_edge_t edge, void *arg);
+
+void remote_close();
+
+#endif
@@ -0,0 +1,294 @@
+/*
+
+    replay recorded paddle traces through the keyer state machine on
+    virtual time, as fast as the CPU allows, no GPIO or JACK needed.
+
+    the keyer runs exactly as the -t 2 engine in iambic.c does: one tick
+    per microsecond, the paddles sampled every KEYER_POLL_US whilst an
+    element runs, untimed states taking no time.
+
+    a trace is one paddle edge per line, # starts a comment:
+
+        <microseconds> <L|R> <1=closed|0=open>
+
+    the keyed output goes to stdout as one edge per line:
+
+        <microseconds> <1=key down|0=key up>
+
+    with -P, and the PTT edges as <microseconds> P <1|0>.
+
+    with -D the edges go through the paddle debounce first, as they do
+    in iambic -D, hold-offs and all.
+
+    and a summary of the element timing in PARIS dot lengths to stderr.
+
+    replay [-m mode] [-s speed_wpm] [-w weight] [-c strict_char_spacing]
+           [-r keys_reversed] [-P ptt_lead_us,ptt_tail_us]
+           [-D make_us,break_us] [-q] [trace ...]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "keyer.h"
+
+#define KEYER_POLL_US 1000
+
+static uint64_t now;		/* virtual time, us */
+static int wakeups;		/* paddle events the keyer hasn't woken for yet */
+static int quiet = 0;
+
+static keyer_t keyer;
+static int mode = KEYER_MODE_B, speed = 20, weight = 55, spacing = 0, reversed = 0;
+static int ptt_lead = -1, ptt_tail;	/* us, -1 for no PTT */
+
+static uint32_t debounce_make, debounce_break;	/* us, 0 for none */
+static keyer_debounce_t debounce[2];
+static uint64_t settle_at[2];		/* the end of a paddle's hold-off, 0 if none is pending */
+static int bounces;
+
+static uint64_t last_edge;
+static int last_state;
+static struct {
+    int n;
+    double min, max, sum;
+} marks[2], spaces[3];		/* dot, dash; element, letter, word spacing */
+
+static void element(int state, double dots) {
+    int k;
+
+    if (state) {		/* a space just ended */
+        if (dots >= 10)
+            return;		/* the operator stopped */
+        k = dots < 2 ? 0 : dots < 5 ? 1 : 2;
+        if (spaces[k].n++ == 0 || dots < spaces[k].min) spaces[k].min = dots;
+        if (dots > spaces[k].max) spaces[k].max = dots;
+        spaces[k].sum += dots;
+    }
+    else {			/* a mark just ended */
+        k = dots >= 2;
+        if (marks[k].n++ == 0 || dots < marks[k].min) marks[k].min = dots;
+        if (dots > marks[k].max) marks[k].max = dots;
+        marks[k].sum += dots;
+    }
+}
+
+static void set_keyer_out(void *arg, int state) {
+    if (state == last_state)
+        return;
+    if (last_edge != 0 || state == 0)
+        element(state, (double)(now - last_edge) / keyer_dot_ticks(&keyer));
+    last_edge = now;
+    last_state = state;
+    if (!quiet)
+        printf("%llu %d\n", (unsigned long long)now, state);
+}
+
+static void set_ptt_out(void *arg, int state) {
+    if (!quiet)
+        printf("%llu P %d\n", (unsigned long long)now, state);
+}
+
+/* one poll interval or the rest of the timed state, whichever is shorter */
+static void chunk() {
+    int hold = keyer_hold(&keyer);
+
+    if (hold > KEYER_POLL_US && keyer_polling(&keyer))
+        hold = KEYER_POLL_US;
+    keyer_run(&keyer, hold);
+    now += hold;
+    keyer_run(&keyer, 0);
+}
+
+/* an idle keyer wakes for a pending paddle event, like sem_wait() */
+static int wake() {
+    if (wakeups == 0)
+        return 0;
+    wakeups--;
+    keyer_start(&keyer);
+    keyer_run(&keyer, 0);
+    return 1;
+}
+
+/* run the keyer until it goes idle, or time t has been reached */
+static void run_until(uint64_t t) {
+    while (now < t) {
+        if (keyer_idle(&keyer) && !wake())
+            break;
+        if (!keyer_idle(&keyer))
+            chunk();
+    }
+}
+
+static void paddle(uint64_t t, int right, int state) {
+    run_until(t);
+    if (now < t)
+        now = t;
+    keyer_paddle(&keyer, right, state);
+    if (state || mode == KEYER_STRAIGHT)
+        wakeups++;
+    if (keyer_idle(&keyer))
+        wake();
+}
+
+/* the hold-offs that end by t, in order, as the watchdog would */
+static void settle_until(uint64_t t) {
+    uint32_t wait;
+    int right, r;
+
+    for (;;) {
+        right = (settle_at[1] && (!settle_at[0] || settle_at[1] < settle_at[0]));
+        if (!settle_at[right] || settle_at[right] > t)
+            return;
+        r = keyer_debounce_settle(&debounce[right], (uint32_t)settle_at[right],
+                                  debounce_make, debounce_break, &wait);
+        if (r > 0)
+            paddle(settle_at[right], right, debounce[right].state);
+        settle_at[right] = (r < 0) ? settle_at[right] + wait : 0;
+    }
+}
+
+/* an edge of the trace, through the debounce as keyer_event() does it */
+static void paddle_debounced(uint64_t t, int right, int state) {
+    uint32_t wait;
+    int r;
+
+    settle_until(t);
+    r = keyer_debounce_edge(&debounce[right], state, (uint32_t)t, debounce_make, debounce_break, &wait);
+    if (r > 0)
+        paddle(t, right, state);
+    else if (r < 0) {
+        bounces++;
+        settle_at[right] = t + wait;
+    }
+}
+
+static int replay(FILE *f, const char *name) {
+    char line[256], side;
+    unsigned long long t;
+    int state, n = 0, lineno = 0;
+
+    now = last_edge = 0;
+    last_state = wakeups = 0;
+    memset(debounce, 0, sizeof(debounce));
+    debounce[0].tick = debounce[1].tick = debounce[0].raw_tick = debounce[1].raw_tick =
+        -(debounce_make + debounce_break);
+    settle_at[0] = settle_at[1] = 0;
+    bounces = 0;
+    keyer_init(&keyer, set_keyer_out, NULL);
+    keyer_set_clock(&keyer, 1000000, 1);
+    keyer.mode = mode;
+    keyer.speed = speed;
+    keyer.weight = weight;
+    keyer.spacing = spacing;
+    keyer.reversed = reversed;
+    if (ptt_lead >= 0)
+        keyer_set_ptt(&keyer, set_ptt_out, ptt_lead, ptt_tail);
+    keyer_update(&keyer);
+
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t");
+        lineno++;
+        if (*p == '#' || *p == '\n' || *p == 0)
+            continue;
+        if (sscanf(p, "%llu %c %d", &t, &side, &state) != 3 || (side != 'L' && side != 'R')) {
+            fprintf(stderr, "%s:%d: expected <us> <L|R> <0|1>\n", name, lineno);
+            return -1;
+        }
+        paddle_debounced(t, side == 'R', state != 0);
+        n++;
+    }
+    settle_until(UINT64_MAX);
+    run_until(UINT64_MAX);
+    return n;
+}
+
+static void summary(const char *name, const char *what, int n, double min, double max, double sum) {
+    if (n)
+        fprintf(stderr, "%s: %-14s n %5d min %6.3f avg %6.3f max %6.3f dots\n",
+                name, what, n, min, sum / n, max);
+}
+
+int main(int argc, char **argv) {
+    int i, k, n;
+    FILE *f;
+
+    for (i = 1; i < argc; i++)
+        if (argv[i][0] == '-' && argv[i][1] != 0)
+            switch (argv[i][1]) {
+            case 'c':
+                spacing = atoi(argv[++i]);
+                break;
+            case 'D':
+                switch (sscanf(argv[++i], "%u,%u", &debounce_make, &debounce_break)) {
+                case 1:
+                    debounce_break = debounce_make;
+                    break;
+                case 2:
+                    break;
+                default:
+                    fprintf(stderr, "-D wants make_us[,break_us]\n");
+                    exit(1);
+                }
+                break;
+            case 'm':
+                mode = atoi(argv[++i]);
+                break;
+            case 'P':
+                if (sscanf(argv[++i], "%d,%d", &ptt_lead, &ptt_tail) != 2) {
+                    fprintf(stderr, "-P wants lead_us,tail_us\n");
+                    exit(1);
+                }
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'r':
+                reversed = atoi(argv[++i]);
+                break;
+            case 's':
+                speed = atoi(argv[++i]);
+                break;
+            case 'w':
+                weight = atoi(argv[++i]);
+                break;
+            default:
+                fprintf(stderr,
+                        "replay [-m mode (0=straight or bug, 1=iambic_a, 2=iambic_b)]\n"
+                        "       [-s speed_wpm] [-w weight (33-66)] [-c strict_char_spacing (0=off, 1=on)]\n"
+                        "       [-r keys_reversed (0=off, 1=on)] [-P PTT lead_us,tail_us]\n"
+                        "       [-D paddle debounce hold-off in us after a make[,after a break]]\n"
+                        "       [-q no edges on stdout] [trace ...]\n");
+                exit(1);
+            }
+        else break;
+
+    do {
+        const char *name = (i < argc) ? argv[i] : "-";
+
+        f = (i < argc && strcmp(argv[i], "-") != 0) ? fopen(argv[i], "r") : stdin;
+        if (f == NULL) {
+            perror(argv[i]);
+            exit(1);
+        }
+        memset(marks, 0, sizeof(marks));
+        memset(spaces, 0, sizeof(spaces));
+        n = replay(f, name);
+        if (f != stdin)
+            fclose(f);
+        if (n < 0)
+            exit(1);
+
+        if (bounces)
+            fprintf(stderr, "%s: %d edges held back by the debounce\n", name, bounces);
+        summary(name, "dot", marks[0].n, marks[0].min, marks[0].max, marks[0].sum);
+        summary(name, "dash", marks[1].n, marks[1].min, marks[1].max, marks[1].sum);
+        for (k = 0; k < 3; k++)
+            summary(name, k == 0 ? "element space" : k == 1 ? "letter space" : "word space",
+                    spaces[k].n, spaces[k].min, spaces[k].max, spaces[k].sum);
+    } while (++i < argc);
+
+    return 0;
+}